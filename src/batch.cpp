@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "chip8.h"
+#include "script.h"
+
+// Batch runner: many emulator sessions in one process, spread over a pool of
+// worker threads. Sessions run in slices, an unfinished session goes back on
+// its worker's queue and idle workers steal from the others, so one long
+// session doesn't keep the rest of the pool waiting.
+
+// Instructions a session runs before going back on a queue
+static const int SLICE_CYCLES = 1 << 16;
+
+struct Session {
+	std::string rom;
+	const std::vector<byte>* image;
+	uint64_t budget;
+	KeyScript script;
+
+	// Created on the first slice and dropped after the last
+	std::unique_ptr<Chip8> chip8;
+
+	// Final state
+	bool done;
+	std::string error;
+	uint64_t cycles;
+	uint32_t stateHash;
+};
+
+// Sessions waiting for a slice. The owner takes the next one from the back
+// and puts an unfinished one back at the front, so its sessions take turns.
+// Thieves take from the back too, the session that has waited longest
+struct WorkQueue {
+	std::mutex lock;
+	std::deque<Session*> sessions;
+};
+
+struct Worker {
+	WorkQueue queue;
+	uint64_t instructions;
+	uint64_t waited;
+	int slices;
+	int steals;
+};
+
+static void printUsage(const char* name) {
+	printf("Usage: %s [options] <jobfile>\n", name);
+	printf("       %s [options] --rom PATH --instances N --cycles N\n", name);
+	printf("  --threads N  worker threads (default: one per core)\n");
+	printf("  --sessions   print the final state of every session\n");
+	printf("Each job file line is a session: CYCLES [AT:KEY:STATE ...] ROM\n");
+	printf("AT is an instruction number, KEY 0-F and STATE 1 to press or 0 to release.\n");
+}
+
+// Parse one job file line, returns false if it isn't a session
+static bool parseSession(const char* line, Session& session) {
+	unsigned long long budget;
+	int length;
+	if (sscanf(line, " %llu%n", &budget, &length) != 1) {
+		return false;
+	}
+	session.budget = budget;
+	line += length;
+
+	// Key events up to the first token that isn't one, the rest is the ROM path
+	for (;;) {
+		KeyEvent e;
+		length = parseKeyEvent(line, e);
+		if (length == 0) {
+			break;
+		}
+		session.script.add(e);
+		line += length;
+	}
+	while (*line == ' ' || *line == '\t') {
+		line++;
+	}
+	session.rom = line;
+	while (!session.rom.empty() && strchr(" \t\r\n", session.rom.back()) != NULL) {
+		session.rom.pop_back();
+	}
+	return !session.rom.empty();
+}
+
+static bool readJobFile(const char* fileName, std::vector<Session>& sessions) {
+	FILE* file = fopen(fileName, "r");
+	if (file == NULL) {
+		printf("Unable to open %s\n", fileName);
+		return false;
+	}
+	char line[4096];
+	int number = 0;
+	bool ok = true;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		number++;
+		const char* start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+			continue;
+		}
+		Session session;
+		if (!parseSession(start, session)) {
+			printf("%s:%d: not a session\n", fileName, number);
+			ok = false;
+			break;
+		}
+		sessions.push_back(std::move(session));
+	}
+	fclose(file);
+	return ok;
+}
+
+// Run one slice of a session, returns true once the session is finished
+static bool runSlice(Session& session, Worker& worker) {
+	if (!session.chip8) {
+		session.chip8.reset(new Chip8());
+		session.chip8->initialize();
+		if (!session.chip8->loadRom(session.image->data(), session.image->size())) {
+			session.error = session.chip8->error;
+			session.done = true;
+			session.chip8.reset();
+			return true;
+		}
+	}
+	Chip8& chip8 = *session.chip8;
+
+	uint64_t start = chip8.cycles;
+	uint64_t waited = session.script.waited;
+	uint64_t end = std::min<uint64_t>(session.budget, start + SLICE_CYCLES);
+	bool finished = false;
+	while (chip8.cycles < end) {
+		// Run up to the next key event or the end of the slice
+		session.script.apply(chip8);
+		Chip8::RunResult result = session.script.run(chip8, end);
+		if (result == Chip8::RUN_ERROR) {
+			session.error = chip8.error;
+			finished = true;
+			break;
+		}
+		if (result == Chip8::RUN_KEY_WAIT && !session.script.pending()) {
+			// No key is ever coming, the rest of the budget passes
+			session.script.skip(chip8, session.budget);
+		}
+	}
+	waited = session.script.waited - waited;
+	worker.instructions += chip8.cycles - start - waited;
+	worker.waited += waited;
+	worker.slices++;
+
+	if (!finished && chip8.cycles < session.budget) {
+		return false;
+	}
+	session.cycles = chip8.cycles;
+	session.stateHash = hashState(chip8);
+	session.done = true;
+	session.chip8.reset();
+	return true;
+}
+
+static Session* popOwn(Worker& worker) {
+	std::lock_guard<std::mutex> guard(worker.queue.lock);
+	if (worker.queue.sessions.empty()) {
+		return NULL;
+	}
+	Session* session = worker.queue.sessions.back();
+	worker.queue.sessions.pop_back();
+	return session;
+}
+
+static Session* steal(std::vector<Worker>& workers, size_t thief) {
+	for (size_t i = 1; i < workers.size(); i++) {
+		Worker& victim = workers[(thief + i) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.queue.lock);
+		if (!victim.queue.sessions.empty()) {
+			Session* session = victim.queue.sessions.back();
+			victim.queue.sessions.pop_back();
+			return session;
+		}
+	}
+	return NULL;
+}
+
+static void workerLoop(std::vector<Worker>& workers, size_t index) {
+	Worker& worker = workers[index];
+	for (;;) {
+		Session* session = popOwn(worker);
+		if (session == NULL) {
+			session = steal(workers, index);
+			if (session == NULL) {
+				// Every remaining session is being run by another worker. Only the
+				// worker that ran a slice queues the session again, so from here on
+				// no queue ever holds more than its owner's one session
+				return;
+			}
+			worker.steals++;
+		}
+
+		if (!runSlice(*session, worker)) {
+			std::lock_guard<std::mutex> guard(worker.queue.lock);
+			worker.queue.sessions.push_front(session);
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int threads = (int)std::thread::hardware_concurrency();
+	bool printSessions = false;
+	const char* jobFile = NULL;
+	std::string rom;
+	int instances = 0;
+	uint64_t cycles = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--sessions") {
+			printSessions = true;
+		}
+		else if ((arg == "--threads" || arg == "--rom" || arg == "--instances" || arg == "--cycles") && i + 1 < argc) {
+			const char* value = argv[++i];
+			if (arg == "--threads") {
+				threads = atoi(value);
+			}
+			else if (arg == "--rom") {
+				rom = value;
+			}
+			else if (arg == "--instances") {
+				instances = atoi(value);
+			}
+			else {
+				cycles = strtoull(value, NULL, 10);
+			}
+		}
+		else if (arg.compare(0, 2, "--") != 0 && jobFile == NULL) {
+			jobFile = argv[i];
+		}
+		else {
+			printUsage(argv[0]);
+			return 2;
+		}
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+
+	std::vector<Session> sessions;
+	if (jobFile != NULL) {
+		if (!readJobFile(jobFile, sessions)) {
+			return 1;
+		}
+	}
+	else if (!rom.empty() && instances > 0 && cycles > 0) {
+		sessions.resize(instances);
+		for (Session& session : sessions) {
+			session.rom = rom;
+			session.budget = cycles;
+		}
+	}
+	else {
+		printUsage(argv[0]);
+		return 2;
+	}
+
+	// Each ROM is read once and shared by every session that runs it
+	std::map<std::string, std::vector<byte> > images;
+	for (Session& session : sessions) {
+		std::vector<byte>& image = images[session.rom];
+		std::string error;
+		if (image.empty() && !Chip8::readRom(session.rom, image, error)) {
+			printf("%s: %s\n", session.rom.c_str(), error.c_str());
+			return 1;
+		}
+		session.image = &image;
+		session.done = false;
+		session.cycles = 0;
+		session.stateHash = 0;
+	}
+
+	// Deal the sessions out round robin, stealing evens out the rest
+	std::vector<Worker> workers(threads);
+	for (Worker& worker : workers) {
+		worker.instructions = 0;
+		worker.waited = 0;
+		worker.slices = 0;
+		worker.steals = 0;
+	}
+	for (size_t i = 0; i < sessions.size(); i++) {
+		workers[i % threads].queue.sessions.push_back(&sessions[i]);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (int i = 0; i < threads; i++) {
+		pool.push_back(std::thread(workerLoop, std::ref(workers), (size_t)i));
+	}
+	for (std::thread& thread : pool) {
+		thread.join();
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	int failed = 0;
+	for (size_t i = 0; i < sessions.size(); i++) {
+		const Session& session = sessions[i];
+		if (!session.error.empty()) {
+			failed++;
+		}
+		if (printSessions || !session.error.empty()) {
+			printf("session %u  %s  cycles %llu  state %08x%s%s\n", (unsigned)i, session.rom.c_str(),
+				(unsigned long long)session.cycles, session.stateHash,
+				session.error.empty() ? "" : "  error: ", session.error.c_str());
+		}
+	}
+
+	// Cycles passed over in key waits are reported apart, they took no time to run
+	uint64_t instructions = 0;
+	uint64_t waited = 0;
+	for (int i = 0; i < threads; i++) {
+		const Worker& worker = workers[i];
+		instructions += worker.instructions;
+		waited += worker.waited;
+		printf("thread %2d  %12llu instructions  %12llu waited  %7d slices  %5d steals\n", i,
+			(unsigned long long)worker.instructions, (unsigned long long)worker.waited, worker.slices, worker.steals);
+	}
+	printf("%u sessions (%d failed) on %d threads\n", (unsigned)sessions.size(), failed, threads);
+	printf("%llu instructions in %.3f s, %.1f M instructions/s, %llu cycles waited for keys\n",
+		(unsigned long long)instructions, elapsed, elapsed > 0 ? instructions / elapsed / 1e6 : 0.0,
+		(unsigned long long)waited);
+
+	return failed > 0 ? 1 : 0;
+}
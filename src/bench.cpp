@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#ifdef _WIN32
+#define NOMINMAX // keep std::min and std::max usable
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include "chip8.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "script.h"
+
+// Throughput benchmark: runs each ROM headless for a fixed number of
+// instructions, several times, and reports the spread. Input and random
+// numbers are scripted so every run executes the same instructions.
+
+// Where the ROMs run without any given come from
+static const char* const DEFAULT_ROM_DIR = "games";
+
+static const unsigned int RANDOM_SEED = 0xC8C8;
+
+// Instructions --check runs every program for
+static const uint64_t CHECK_CYCLES = 300000;
+
+// A --check program for the opcodes where lanes and Chip8 could part ways:
+// draws at random places with VF as a coordinate, so rows after a collision
+// move, a sound that runs out, a delay timer poll, self-modifying BCD and
+// register stores, a key wait and a jump to itself
+static const byte CHECK_PROGRAM[] = {
+	0x00, 0xE0, // 200: 00E0      clear the screen
+	0xA2, 0x40, // 202: A240      I = sprite
+	0xC0, 0x3F, // 204: C03F      V0 = random & 3F
+	0xC1, 0x1F, // 206: C11F      V1 = random & 1F
+	0xD0, 0x14, // 208: D014      draw at V0, V1
+	0x8F, 0x00, // 20A: 8F00      VF = V0
+	0xDF, 0x15, // 20C: DF15      draw at VF, V1
+	0xD0, 0xF5, // 20E: D0F5      draw at V0, VF
+	0xDF, 0xF3, // 210: DFF3      draw at VF, VF
+	0x62, 0x02, // 212: 6202
+	0xF2, 0x18, // 214: F218      sound timer = 2
+	0x63, 0x03, // 216: 6303
+	0xF3, 0x15, // 218: F315      delay timer = 3
+	0xF4, 0x07, // 21A: F407      V4 = delay timer
+	0x34, 0x00, // 21C: 3400      until it is 0
+	0x12, 0x1A, // 21E: 121A
+	0x75, 0x01, // 220: 7501      V5 += 1
+	0x35, 0x10, // 222: 3510      16 rounds
+	0x12, 0x04, // 224: 1204
+	0xA3, 0x00, // 226: A300
+	0xF5, 0x33, // 228: F533      BCD of V5 at 300
+	0xFF, 0x55, // 22A: FF55      V0 to VF at 300
+	0xF0, 0x0A, // 22C: F00A      wait for a key
+	0x12, 0x2E, // 22E: 122E      jump to itself
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 230
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, // 240: sprite
+};
+
+#if C8_DISPATCH == C8_DISPATCH_TABLE
+static const char* const ENGINE = "table";
+#elif C8_DISPATCH == C8_DISPATCH_THREADED
+static const char* const ENGINE = C8_FUSION ? "threaded+fusion" : "threaded";
+#elif C8_DISPATCH == C8_DISPATCH_SPECIALIZED
+static const char* const ENGINE = "specialized";
+#else
+static const char* const ENGINE = "switch";
+#endif
+
+// One timed run of a ROM
+struct Sample {
+	double seconds;
+	uint64_t instructions;
+	double lanesPerStep;
+};
+
+// Summary of the samples of one ROM
+struct Result {
+	std::string rom;
+	std::string error;
+	uint64_t instructions;
+	uint32_t stateHash;
+	double ipsMean, ipsStddev, ipsMin, ipsMax;
+	double nsPerInstruction;
+	double fps;
+	double lanesPerStep;
+};
+
+static void printUsage(const char* name) {
+	printf("Usage: %s [options] [rom...]\n", name);
+	printf("  --cycles N  instructions per run (default 10000000)\n");
+	printf("  --reps N    timed runs per ROM (default 5)\n");
+	printf("  --rate N    instructions per emulated second (default %d)\n", Chip8::DEFAULT_CYCLES_PER_SECOND);
+	printf("  --lanes N   run N instances of each ROM in lockstep, counting the instructions of all of them\n");
+	printf("  --jit       experimental, run through the recompiler (native code on x86-64 hosts),\n");
+	printf("              slower than the interpreter for now\n");
+	printf("  --json      print the results as JSON\n");
+	printf("  --check     instead of timing, compare every lane (--lanes, default 8) with Chip8\n");
+	printf("              after every run, on a built-in program and the ROMs\n");
+	printf("Without ROMs, every ROM in games/ is run.\n");
+}
+
+// The files in dir, sorted by name so the report keeps its order
+static std::vector<std::string> listRoms(const std::string& dir) {
+	std::vector<std::string> roms;
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &entry);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			if ((entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+				roms.push_back(dir + "/" + entry.cFileName);
+			}
+		} while (FindNextFileA(find, &entry));
+		FindClose(find);
+	}
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d != NULL) {
+		while (dirent* entry = readdir(d)) {
+			std::string path = dir + "/" + entry->d_name;
+			struct stat info;
+			if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+				roms.push_back(path);
+			}
+		}
+		closedir(d);
+	}
+#endif
+	std::sort(roms.begin(), roms.end());
+	return roms;
+}
+
+// Run a ROM for the given number of instructions, through jit if given. A key
+// wait is answered with the next key of a fixed sequence, released again one
+// frame later
+static bool runOnce(Chip8& chip8, Jit* jit, const std::string& rom, uint64_t instructions, int rate,
+		Sample& sample, uint32_t& stateHash, std::string& error) {
+	chip8.initialize();
+	chip8.rng.seed(RANDOM_SEED);
+	chip8.setCyclesPerSecond(rate);
+	if (!chip8.loadGame(rom)) {
+		error = chip8.error;
+		return false;
+	}
+	if (jit != NULL) {
+		jit->reset();
+	}
+
+	int cyclesPerFrame = std::max(1, rate / Chip8::TIMER_FREQUENCY);
+	int nextKey = 0;
+	int heldKey = -1;
+	auto start = std::chrono::steady_clock::now();
+	while (chip8.cycles < instructions) {
+		int count = (int)std::min<uint64_t>(instructions - chip8.cycles, cyclesPerFrame);
+		Chip8::RunResult result = jit != NULL ? jit->runCycles(chip8, count) : chip8.runCycles(count);
+		if (heldKey >= 0) {
+			chip8.setKey(heldKey, false);
+			heldKey = -1;
+		}
+		if (result == Chip8::RUN_ERROR) {
+			error = chip8.error;
+			return false;
+		}
+		if (result == Chip8::RUN_KEY_WAIT) {
+			heldKey = nextKey;
+			nextKey = (nextKey + 1) & 0xF;
+			chip8.setKey(heldKey, true);
+		}
+	}
+	sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	sample.instructions = chip8.cycles;
+	sample.lanesPerStep = 1;
+	stateHash = hashState(chip8);
+	return true;
+}
+
+// The same run for every lane of a Lockstep, each lane answering its own key waits
+static bool runLockstepOnce(Chip8& chip8, Lockstep& lockstep, const std::string& rom, uint64_t instructions,
+		int rate, Sample& sample, uint32_t& stateHash, std::string& error) {
+	chip8.initialize();
+	chip8.rng.seed(RANDOM_SEED);
+	chip8.setCyclesPerSecond(rate);
+	if (!chip8.loadGame(rom)) {
+		error = chip8.error;
+		return false;
+	}
+	lockstep.load(chip8);
+
+	int lanes = lockstep.lanes();
+	int cyclesPerFrame = std::max(1, rate / Chip8::TIMER_FREQUENCY);
+	std::vector<int> nextKey(lanes, 0);
+	std::vector<int> heldKey(lanes, -1);
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t done = 0; done < instructions; ) {
+		int count = (int)std::min<uint64_t>(instructions - done, cyclesPerFrame);
+		lockstep.run(count);
+		done += count;
+		for (int l = 0; l < lanes; l++) {
+			if (heldKey[l] >= 0) {
+				lockstep.setKey(l, heldKey[l], false);
+				heldKey[l] = -1;
+			}
+			if (!lockstep.error(l).empty()) {
+				error = lockstep.error(l);
+				return false;
+			}
+			if (lockstep.waiting(l)) {
+				heldKey[l] = nextKey[l];
+				nextKey[l] = (nextKey[l] + 1) & 0xF;
+				lockstep.setKey(l, heldKey[l], true);
+			}
+		}
+	}
+	sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	sample.instructions = 0;
+	for (int l = 0; l < lanes; l++) {
+		sample.instructions += lockstep.laneCycles(l);
+	}
+	sample.lanesPerStep = (double)lockstep.laneInstructions / std::max<uint64_t>(lockstep.steps, 1);
+
+	// Every lane ran the same, the first one stands for all of them
+	lockstep.store(0, chip8);
+	stateHash = hashState(chip8);
+	return true;
+}
+
+// Run a program on every lane of a Lockstep and, one lane at a time, on a
+// Chip8 given the same seed and keys, and compare the whole machines after
+// every run. Lanes get different seeds so they part and meet again
+static bool checkLockstep(const std::vector<byte>& image, int lanes, int rate, std::string& error) {
+	Chip8 source;
+	source.initialize();
+	source.setCyclesPerSecond(rate);
+	if (!source.loadRom(image.data(), image.size())) {
+		error = source.error;
+		return false;
+	}
+	Lockstep lockstep(lanes);
+	lockstep.load(source);
+
+	std::vector<std::unique_ptr<Chip8>> reference;
+	for (int l = 0; l < lanes; l++) {
+		lockstep.seedLane(l, RANDOM_SEED + l);
+		reference.push_back(std::unique_ptr<Chip8>(new Chip8()));
+		Chip8& chip8 = *reference.back();
+		chip8.initialize();
+		chip8.setCyclesPerSecond(rate);
+		chip8.loadRom(image.data(), image.size());
+		chip8.rng.seed(RANDOM_SEED + l);
+	}
+
+	std::unique_ptr<Chip8> lane(new Chip8());
+	Chip8::State expected, actual;
+	int batch = 0;
+	for (uint64_t done = 0; done < CHECK_CYCLES; done += batch) {
+		// Runs of 1 to 23 instructions, so they end anywhere between timer ticks
+		batch = 1 + (int)(done % 23);
+		lockstep.run(batch);
+		for (int l = 0; l < lanes; l++) {
+			Chip8& chip8 = *reference[l];
+			Chip8::RunResult result = chip8.runCycles(batch);
+			lockstep.store(l, *lane);
+			chip8.saveState(expected);
+			lane->saveState(actual);
+			if (memcmp(&expected, &actual, sizeof(expected)) != 0 ||
+					(result == Chip8::RUN_ERROR) != !lockstep.error(l).empty()) {
+				char where[80];
+				snprintf(where, sizeof(where), "lane %d differs from Chip8 at instruction %llu", l,
+					(unsigned long long)chip8.cycles);
+				error = where;
+				return false;
+			}
+			if (result == Chip8::RUN_ERROR) {
+				return true;
+			}
+			// Both answer a key wait with a key of their own, released after the next run
+			if (result == Chip8::RUN_KEY_WAIT) {
+				int key = (int)((done + l) & 0xF);
+				chip8.setKey(key, true);
+				lockstep.setKey(l, key, true);
+			}
+			else {
+				for (int k = 0; k < 16; k++) {
+					chip8.setKey(k, false);
+					lockstep.setKey(l, k, false);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+static bool runOnce(Chip8& chip8, Lockstep* lockstep, Jit* jit, const std::string& rom, uint64_t instructions,
+		int rate, Sample& sample, uint32_t& stateHash, std::string& error) {
+	if (lockstep != NULL) {
+		return runLockstepOnce(chip8, *lockstep, rom, instructions, rate, sample, stateHash, error);
+	}
+	return runOnce(chip8, jit, rom, instructions, rate, sample, stateHash, error);
+}
+
+static Result benchRom(Chip8& chip8, Lockstep* lockstep, Jit* jit, const std::string& rom, uint64_t instructions,
+		int reps, int rate) {
+	Result result;
+	result.rom = rom;
+	result.instructions = instructions;
+	result.stateHash = 0;
+
+	// One untimed run to warm caches and the decode tables
+	Sample sample;
+	if (!runOnce(chip8, lockstep, jit, rom, instructions, rate, sample, result.stateHash, result.error)) {
+		return result;
+	}
+
+	std::vector<double> ips;
+	for (int i = 0; i < reps; i++) {
+		uint32_t hash;
+		if (!runOnce(chip8, lockstep, jit, rom, instructions, rate, sample, hash, result.error)) {
+			return result;
+		}
+		if (hash != result.stateHash) {
+			result.error = "runs are not deterministic";
+			return result;
+		}
+		ips.push_back(sample.instructions / std::max(sample.seconds, 1e-9));
+	}
+
+	double sum = 0;
+	for (double v : ips) {
+		sum += v;
+	}
+	result.ipsMean = sum / reps;
+	double squares = 0;
+	for (double v : ips) {
+		squares += (v - result.ipsMean) * (v - result.ipsMean);
+	}
+	result.ipsStddev = reps > 1 ? sqrt(squares / (reps - 1)) : 0;
+	result.ipsMin = *std::min_element(ips.begin(), ips.end());
+	result.ipsMax = *std::max_element(ips.begin(), ips.end());
+	result.nsPerInstruction = 1e9 / result.ipsMean;
+	result.fps = result.ipsMean * Chip8::TIMER_FREQUENCY / rate;
+	result.lanesPerStep = sample.lanesPerStep;
+	return result;
+}
+
+// Quote a string for JSON, ROM names only need quotes and backslashes escaped
+static std::string jsonString(const std::string& s) {
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+// The engine a run went through, for the report
+static std::string engineName(int lanes, bool jit) {
+	if (lanes > 0) {
+		return "lockstep";
+	}
+	return jit ? std::string(ENGINE) + "+jit" : ENGINE;
+}
+
+static void printJson(const std::vector<Result>& results, uint64_t instructions, int reps, int rate, int lanes, bool jit) {
+	printf("{\n");
+	printf("  \"engine\": \"%s\",\n", engineName(lanes, jit).c_str());
+	printf("  \"lanes\": %d,\n", lanes > 0 ? lanes : 1);
+	printf("  \"instructions\": %llu,\n", (unsigned long long)instructions);
+	printf("  \"reps\": %d,\n", reps);
+	printf("  \"rate\": %d,\n", rate);
+	printf("  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		printf("    {\"rom\": %s, ", jsonString(r.rom).c_str());
+		if (!r.error.empty()) {
+			printf("\"error\": %s}", jsonString(r.error).c_str());
+		}
+		else {
+			printf("\"state\": \"%08x\", \"ips_mean\": %.0f, \"ips_stddev\": %.0f, \"ips_min\": %.0f, \"ips_max\": %.0f, "
+				"\"ns_per_instruction\": %.3f, \"fps\": %.0f, \"lanes_per_step\": %.2f}",
+				r.stateHash, r.ipsMean, r.ipsStddev, r.ipsMin, r.ipsMax, r.nsPerInstruction, r.fps, r.lanesPerStep);
+		}
+		printf("%s\n", i + 1 < results.size() ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+}
+
+static void printTable(const std::vector<Result>& results, uint64_t instructions, int reps, int rate, int lanes, bool jit) {
+	if (lanes > 0) {
+		printf("lockstep x %d lanes, %llu instructions per lane x %d runs at %d instructions/s\n\n",
+			lanes, (unsigned long long)instructions, reps, rate);
+	}
+	else {
+		printf("engine %s, %llu instructions x %d runs at %d instructions/s\n\n",
+			engineName(lanes, jit).c_str(), (unsigned long long)instructions, reps, rate);
+	}
+	printf("%-44s %8s %10s %8s %8s %10s %10s\n", "rom", "state", "M instr/s", "+/- %", "ns/instr", "frames/s", "lanes/step");
+	for (const Result& r : results) {
+		if (!r.error.empty()) {
+			printf("%-44s %s\n", r.rom.c_str(), r.error.c_str());
+			continue;
+		}
+		printf("%-44s %08x %10.2f %8.1f %8.2f %10.0f %10.2f\n", r.rom.c_str(), r.stateHash, r.ipsMean / 1e6,
+			100 * r.ipsStddev / r.ipsMean, r.nsPerInstruction, r.fps, r.lanesPerStep);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t instructions = 10000000;
+	int reps = 5;
+	int rate = Chip8::DEFAULT_CYCLES_PER_SECOND;
+	int lanes = 0;
+	bool json = false;
+	bool useJit = false;
+	bool check = false;
+	std::vector<std::string> roms;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--json") {
+			json = true;
+		}
+		else if (arg == "--jit") {
+			useJit = true;
+		}
+		else if (arg == "--check") {
+			check = true;
+		}
+		else if ((arg == "--cycles" || arg == "--reps" || arg == "--rate" || arg == "--lanes") && i + 1 < argc) {
+			const char* value = argv[++i];
+			if (arg == "--cycles") {
+				instructions = strtoull(value, NULL, 10);
+			}
+			else if (arg == "--reps") {
+				reps = atoi(value);
+			}
+			else if (arg == "--lanes") {
+				lanes = atoi(value);
+			}
+			else {
+				rate = atoi(value);
+			}
+		}
+		else if (arg.compare(0, 2, "--") == 0) {
+			printUsage(argv[0]);
+			return 2;
+		}
+		else {
+			roms.push_back(arg);
+		}
+	}
+	if (instructions == 0 || reps <= 0 || rate <= 0 || lanes < 0 || (lanes > 0 && useJit)) {
+		printUsage(argv[0]);
+		return 2;
+	}
+	if (roms.empty()) {
+		roms = listRoms(DEFAULT_ROM_DIR);
+		if (roms.empty()) {
+			fprintf(stderr, "No ROMs given and none found in %s/, run from the repository root.\n", DEFAULT_ROM_DIR);
+			return 2;
+		}
+	}
+
+	if (check) {
+		bool failed = false;
+		std::vector<byte> image(CHECK_PROGRAM, CHECK_PROGRAM + sizeof(CHECK_PROGRAM));
+		std::vector<std::string> names(1, "check program");
+		names.insert(names.end(), roms.begin(), roms.end());
+		for (size_t i = 0; i < names.size(); i++) {
+			std::string error;
+			bool passed = (i == 0 || Chip8::readRom(names[i], image, error)) &&
+				checkLockstep(image, lanes > 0 ? lanes : 8, rate, error);
+			printf("%-44s %s\n", names[i].c_str(), passed ? "lanes match Chip8" : error.c_str());
+			failed |= !passed;
+		}
+		return failed ? 1 : 0;
+	}
+
+	Chip8 chip8;
+	std::unique_ptr<Lockstep> lockstep;
+	if (lanes > 0) {
+		lockstep.reset(new Lockstep(lanes));
+	}
+	std::unique_ptr<Jit> jit;
+	if (useJit) {
+		jit.reset(new Jit());
+	}
+	std::vector<Result> results;
+	bool failed = false;
+	for (const std::string& rom : roms) {
+		results.push_back(benchRom(chip8, lockstep.get(), jit.get(), rom, instructions, reps, rate));
+		failed |= !results.back().error.empty();
+	}
+
+	if (json) {
+		printJson(results, instructions, reps, rate, lanes, useJit);
+	}
+	else {
+		printTable(results, instructions, reps, rate, lanes, useJit);
+	}
+	return failed ? 1 : 0;
+}
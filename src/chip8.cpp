@@ -1,36 +1,174 @@
-#include "stdafx.h"
+#include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <string>
+#include <stdexcept>
 #include "chip8.h"
-#include <SDL.h>
-#include <iostream>
-#include <fstream>
 
 using namespace std;
 
-void Chip8::loadGame() {
-	streampos size;
-    gameName = "games/pong2.c8";
-    ifstream file(gameName, ios::in | ios::binary | ios::ate);
-	if (file.is_open()) {
-		size = file.tellg();
-		byte *ptr;
-		ptr = memory + PROGRAM_START_LOC;
-		file.seekg(0, ios::beg);
-		file.read((char *) ptr, size);
-		file.close();
+bool Chip8::loadRom(const byte* data, size_t size) {
+	if (size > MEMORY_SIZE - PROGRAM_START_LOC) {
+		error = "File too big for memory.";
+		return false;
+	}
+	memcpy(memory + PROGRAM_START_LOC, data, size);
+	flushDecodeCache();
+	return true;
+}
+
+bool Chip8::loadGame(const std::string& fileName) {
+	std::vector<byte> image;
+	return readRom(fileName, image, error) && loadRom(image.data(), image.size());
+}
+
+bool Chip8::readRom(const std::string& fileName, std::vector<byte>& image, std::string& error) {
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (file == NULL) {
+		error = "Unable to open file.";
+		return false;
+	}
+	// One byte more than fits, so loadRom can tell an oversize file
+	image.resize(MEMORY_SIZE - PROGRAM_START_LOC + 1);
+	size_t size = fread(image.data(), 1, image.size(), file);
+	fclose(file);
+	image.resize(size);
+	return true;
+}
+
+// Identifies a save state file, followed by the version and the size of State
+static const char STATE_MAGIC[4] = { 'C', '8', 'S', 'T' };
+
+struct StateFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;
+};
+
+void Chip8::saveState(State& state) const {
+	memcpy(state.gfx, gfx, sizeof(gfx));
+	state.delayTimerStart = delay_timer_start;
+	state.soundTimerStart = sound_timer_start;
+	state.cycles = cycles;
+	state.rngState = rng.state;
+	state.cyclesPerSecond = cyclesPerSecond;
+	state.dirty = dirty;
+	memcpy(state.stack, stack, sizeof(stack));
+	state.sp = sp;
+	state.I = I;
+	state.pc = pc;
+	state.opcode = opcode;
+	memcpy(state.memory, memory, sizeof(memory));
+	memcpy(state.V, V, sizeof(V));
+	memcpy(state.keys, keys, sizeof(keys));
+	state.delayTimer = delay_timer;
+	state.soundTimer = sound_timer;
+	state.drawFlag = drawFlag;
+	state.beep = beep;
+	state.beepPending = beepPending;
+	state.keyWait = keyWait;
+	memset(state.reserved, 0, sizeof(state.reserved));
+}
+
+void Chip8::loadState(const State& state) {
+	// Only the blocks of memory that changed lose their predecoded instructions
+	static const int BLOCK = 64;
+	for (int addr = 0; addr < MEMORY_SIZE; addr += BLOCK) {
+		if (memcmp(memory + addr, state.memory + addr, BLOCK) != 0) {
+			memcpy(memory + addr, state.memory + addr, BLOCK);
+			invalidateDecoded(addr, BLOCK);
+		}
+	}
+	// Rows that differ from the screen being replaced need presenting too
+	uint32_t changed = 0;
+	for (int i = 0; i < SCREEN_HEIGHT; i++) {
+		if (gfx[i] != state.gfx[i]) {
+			changed |= 1u << i;
+		}
+	}
+	memcpy(gfx, state.gfx, sizeof(gfx));
+	delay_timer_start = state.delayTimerStart;
+	sound_timer_start = state.soundTimerStart;
+	cycles = state.cycles;
+	rng.state = state.rngState;
+	cyclesPerSecond = state.cyclesPerSecond;
+	dirty = state.dirty | changed;
+	memcpy(stack, state.stack, sizeof(stack));
+	sp = state.sp;
+	I = state.I;
+	pc = state.pc;
+	opcode = state.opcode;
+	memcpy(V, state.V, sizeof(V));
+	memcpy(keys, state.keys, sizeof(keys));
+	delay_timer = state.delayTimer;
+	sound_timer = state.soundTimer;
+	drawFlag = state.drawFlag != 0;
+	beep = state.beep != 0;
+	beepPending = state.beepPending != 0;
+	keyWait = state.keyWait != 0;
+}
+
+bool Chip8::saveState(const std::string& fileName) {
+	State state;
+	saveState(state);
+	StateFileHeader header;
+	memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+	header.version = STATE_VERSION;
+	header.size = sizeof(State);
 
-		cout << "File loaded complete.\n";
+	FILE* file = fopen(fileName.c_str(), "wb");
+	if (file == NULL) {
+		error = "Unable to create file.";
+		return false;
 	}
-	else cout << "Unable to open file.\n";
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(&state, sizeof(state), 1, file) == 1;
+	if (fclose(file) != 0 || !written) {
+		error = "Unable to write save state.";
+		return false;
+	}
+	return true;
+}
+
+bool Chip8::loadState(const std::string& fileName) {
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (file == NULL) {
+		error = "Unable to open file.";
+		return false;
+	}
+	StateFileHeader header;
+	State state;
+	bool read = fread(&header, sizeof(header), 1, file) == 1;
+	if (read && memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0) {
+		fclose(file);
+		error = "Not a save state.";
+		return false;
+	}
+	if (read && (header.version != STATE_VERSION || header.size != sizeof(State))) {
+		fclose(file);
+		error = "Save state from another version.";
+		return false;
+	}
+	read = read && fread(&state, sizeof(state), 1, file) == 1;
+	fclose(file);
+	if (!read) {
+		error = "Save state is truncated.";
+		return false;
+	}
+	// The interpreter divides by the rate and indexes by the rest without checking
+	if (state.cyclesPerSecond <= 0 || state.sp > NUM_LEVEL_STACK || state.pc >= MEMORY_SIZE) {
+		error = "Save state is damaged.";
+		return false;
+	}
+	loadState(state);
+	return true;
 }
 
 void Chip8::clearScreen() {
 	for (int i = 0; i < SCREEN_HEIGHT; i++) {
-		for (int j = 0; j < SCREEN_WIDTH; j++) {
-			gfx[i][j] = 0;
+		if (gfx[i] != 0) {
+			dirty |= 1u << i;
 		}
+		gfx[i] = 0;
 	}
 }
 
@@ -41,8 +179,9 @@ void Chip8::initialize() {
 	I      = 0;                  // Reset index register
 	sp     = 0;                  // Reset stack pointer
 
-	// Clear display
-	clearScreen();
+	// Clear display, the first present draws all of it
+	memset(gfx, 0, sizeof(gfx));
+	dirty = ~0u >> (32 - SCREEN_HEIGHT);
 
 	// Clear stack
 	for (int i = 0; i < NUM_LEVEL_STACK; i++) {
@@ -54,10 +193,16 @@ void Chip8::initialize() {
 		V[i] = 0;
 	}
 
+	// Release all keys
+	for (int i = 0; i < 16; i++) {
+		keys[i] = 0;
+	}
+
 	// Clear memory
 	for (int i = 0; i < MEMORY_SIZE; i++) {
 		memory[i] = 0;
 	}
+	flushDecodeCache();
 
 	// Load fontset
 	byte chip8_fontset[80] = {
@@ -82,80 +227,155 @@ void Chip8::initialize() {
 	for (int i = 0; i < 80; ++i)
 		memory[i] = chip8_fontset[i];
 
-	// Reset timers
+	// Reset timers and the emulated clock
+	cycles = 0;
+	cyclesPerSecond = DEFAULT_CYCLES_PER_SECOND;
 	delay_timer = 0;
 	sound_timer = 0;
+	delay_timer_start = 0;
+	sound_timer_start = 0;
+	beepPending = false;
+	beep = false;
+	keyWait = false;
+	idle = false;
+	drawFlag = false;
 
-	// initialize random
-	srand((unsigned int)time(NULL));
+	// Same numbers on every run unless the caller picks another seed
+	rng.seed(Random::DEFAULT_SEED);
 }
 
-void Chip8::handleKey(const SDL_Event& e) {
-	if (e.type == SDL_KEYDOWN) {
-		switch (e.key.keysym.sym) {
-		case SDLK_1: keys[0x1] = 1; break;
-		case SDLK_2: keys[0x2] = 1; break;
-		case SDLK_3: keys[0x3] = 1; break;
-		case SDLK_4: keys[0xC] = 1; break;
-
-		case SDLK_q: keys[0x4] = 1; break;
-		case SDLK_w: keys[0x5] = 1; break;
-		case SDLK_e: keys[0x6] = 1; break;
-		case SDLK_r: keys[0xD] = 1; break;
-
-		case SDLK_a: keys[0x7] = 1; break;
-		case SDLK_s: keys[0x8] = 1; break;
-		case SDLK_d: keys[0x9] = 1; break;
-		case SDLK_f: keys[0xE] = 1; break;
-
-		case SDLK_z: keys[0xA] = 1; break;
-		case SDLK_x: keys[0x0] = 1; break;
-		case SDLK_c: keys[0xB] = 1; break;
-		case SDLK_v: keys[0xF] = 1; break;
+void Chip8::drawSprite(byte x, byte y, byte height) {
+	V[0xF] = 0;
+	for (int i = 0; i < height; i++) {
+		// Put the sprite byte on the leftmost pixels, then rotate it to column VX so it wraps around
+		uint64_t row = (uint64_t)memoryAt(I + i) << (SCREEN_WIDTH - 8);
+		int shift = V[x] % SCREEN_WIDTH;
+		if (shift != 0) {
+			row = (row >> shift) | (row << (SCREEN_WIDTH - shift));
+		}
 
-		default:
-			break;
+		int r = (i + V[y]) % SCREEN_HEIGHT;
+		if ((gfx[r] & row) != 0) {
+			V[0xF] = 1;
+		}
+		gfx[r] ^= row;
+		if (row != 0) {
+			dirty |= 1u << r;
 		}
 	}
-	else if (e.type == SDL_KEYUP) {
-		switch (e.key.keysym.sym) {
-		case SDLK_1: keys[0x1] = 0; break;
-		case SDLK_2: keys[0x2] = 0; break;
-		case SDLK_3: keys[0x3] = 0; break;
-		case SDLK_4: keys[0xC] = 0; break;
+}
 
-		case SDLK_q: keys[0x4] = 0; break;
-		case SDLK_w: keys[0x5] = 0; break;
-		case SDLK_e: keys[0x6] = 0; break;
-		case SDLK_r: keys[0xD] = 0; break;
+uint64_t Chip8::timerTicks() const {
+	return cycles * TIMER_FREQUENCY / cyclesPerSecond;
+}
 
-		case SDLK_a: keys[0x7] = 0; break;
-		case SDLK_s: keys[0x8] = 0; break;
-		case SDLK_d: keys[0x9] = 0; break;
-		case SDLK_f: keys[0xE] = 0; break;
+uint64_t Chip8::nextTickCycle() const {
+	return ((timerTicks() + 1) * cyclesPerSecond + TIMER_FREQUENCY - 1) / TIMER_FREQUENCY;
+}
 
-		case SDLK_z: keys[0xA] = 0; break;
-		case SDLK_x: keys[0x0] = 0; break;
-		case SDLK_c: keys[0xB] = 0; break;
-		case SDLK_v: keys[0xF] = 0; break;
+byte Chip8::delayTimer() const {
+	uint64_t elapsed = timerTicks() - delay_timer_start;
+	return elapsed >= delay_timer ? 0 : (byte)(delay_timer - elapsed);
+}
 
-		default:
-			break;
-		}
+byte Chip8::soundTimer() const {
+	uint64_t elapsed = timerTicks() - sound_timer_start;
+	return elapsed >= sound_timer ? 0 : (byte)(sound_timer - elapsed);
+}
+
+void Chip8::setCyclesPerSecond(int rate) {
+	// Keep the running timers where they are
+	byte delay = delayTimer();
+	byte sound = soundTimer();
+	cyclesPerSecond = rate > 0 ? rate : DEFAULT_CYCLES_PER_SECOND;
+	delay_timer = delay;
+	sound_timer = sound;
+	delay_timer_start = sound_timer_start = timerTicks();
+}
+
+void Chip8::updateTimers() {
+	if (beepPending && soundTimer() == 0) {
+		beep = true;
+		beepPending = false;
 	}
 }
 
 void Chip8::emulateCycle() {
+#if C8_DISPATCH == C8_DISPATCH_THREADED
+	emulateCycles(1);
+#else
+	executeCycle();
+	updateTimers();
+#endif
+}
+
+#if C8_DISPATCH != C8_DISPATCH_THREADED
+
+void Chip8::executeCycle() {
 	// mem boundary check
-	if (pc >= MEMORY_SIZE) {
-		throw exception("Program counter is out of memory boundary!");
+	if (pc >= MEMORY_SIZE - 1) {
+		throw runtime_error("Program counter is out of memory boundary!");
 	}
 
+	// reset draw, key wait and idle flags
+	drawFlag = false;
+	keyWait = false;
+	idle = false;
+
+#if C8_DISPATCH == C8_DISPATCH_SPECIALIZED
+	// The whole opcode picks a handler that already knows its operands
+	opcode = memory[pc] << 8 | memory[pc + 1];
+	specializedHandlers[opcode](*this);
+#elif C8_DISPATCH == C8_DISPATCH_TABLE
+	// Decode on first use, afterwards execute straight from the cache
+	Instr& in = decoded[pc];
+	if (in.op == OP_UNDECODED) {
+		in = decode(memory[pc] << 8 | memory[pc + 1]);
+	}
+	opcode = in.opcode;
+	// A switch on the cached id, unlike a call through a handler pointer the
+	// compiler inlines every handler into it
+	switch (in.op) {
+		case OP_00E0: op00E0(in); break;
+		case OP_00EE: op00EE(in); break;
+		case OP_1NNN: op1NNN(in); break;
+		case OP_2NNN: op2NNN(in); break;
+		case OP_3XNN: op3XNN(in); break;
+		case OP_4XNN: op4XNN(in); break;
+		case OP_5XY0: op5XY0(in); break;
+		case OP_6XNN: op6XNN(in); break;
+		case OP_7XNN: op7XNN(in); break;
+		case OP_8XY0: op8XY0(in); break;
+		case OP_8XY1: op8XY1(in); break;
+		case OP_8XY2: op8XY2(in); break;
+		case OP_8XY3: op8XY3(in); break;
+		case OP_8XY4: op8XY4(in); break;
+		case OP_8XY5: op8XY5(in); break;
+		case OP_8XY6: op8XY6(in); break;
+		case OP_8XY7: op8XY7(in); break;
+		case OP_8XYE: op8XYE(in); break;
+		case OP_9XY0: op9XY0(in); break;
+		case OP_ANNN: opANNN(in); break;
+		case OP_BNNN: opBNNN(in); break;
+		case OP_CXNN: opCXNN(in); break;
+		case OP_DXYN: opDXYN(in); break;
+		case OP_EX9E: opEX9E(in); break;
+		case OP_EXA1: opEXA1(in); break;
+		case OP_FX07: opFX07(in); break;
+		case OP_FX0A: opFX0A(in); break;
+		case OP_FX15: opFX15(in); break;
+		case OP_FX18: opFX18(in); break;
+		case OP_FX1E: opFX1E(in); break;
+		case OP_FX29: opFX29(in); break;
+		case OP_FX33: opFX33(in); break;
+		case OP_FX55: opFX55(in); break;
+		case OP_FX65: opFX65(in); break;
+		default:      opUnknown(in); break;
+	}
+#else // C8_DISPATCH_SWITCH
 	// Fetch Opcode
 	opcode = memory[pc] << 8 | memory[pc + 1];
 
-	// reset draw flag
-	drawFlag = false;
 
 	// Decode & execute opcode
 	byte nn     =  opcode & 0x00FF;
@@ -171,22 +391,26 @@ void Chip8::emulateCycle() {
 					pc += 2;
 					break;
 				case 0x000E: // 00EE: returns from subroutine
+					if (sp == 0) throw runtime_error("Stack underflow!");
 					pc = stack[--sp];
 					stack[sp] = 0;
 					pc += 2;
 					break;
 				default:
-					printf("Unknown opcode: 0x%X\n", opcode);
+					fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
 					break;
 			}
 			break;
 		case 0x1000: // 1NNN: jumps to address NNN
+			if (nnn <= pc) {
+				idle = idleLoop(nnn);
+			}
 			pc = nnn;
 			break;
 		case 0x2000: // 2NNN: calls the subroutine at address NNN
+			if (sp >= NUM_LEVEL_STACK) throw runtime_error("Stack overflow!");
 			stack[sp] = pc;
 			++sp;
-			if (sp > NUM_LEVEL_STACK) throw exception("Stack overflow!");
 			pc = nnn;
 			break;
 		case 0x3000: // 3XNN: skips the next instruction if VX equals NN
@@ -259,7 +483,7 @@ void Chip8::emulateCycle() {
 					pc += 2;
 					break;
 				default:
-					printf("Unknown opcode: 0x%X\n", opcode);
+					fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
 					break;
 			}
 			break;
@@ -277,25 +501,12 @@ void Chip8::emulateCycle() {
 			pc = nnn + V[0];
 			break;
 		case 0xC000: // CXNN: sets VX to a random number and NN
-			V[x] = nn & rand();
+			V[x] = nn & rng.next();
 			pc += 2;
 			break;
 		case 0xD000: // DXYN: sprites stored in memory at location in index register (I), maximum 8 bits wide. Wraps around the screen.
 					 //	If when drawn, clears a pixel, register VF is set to 1 otherwise it is zero. All drawing is XOR drawing (i.e.it toggles the screen pixels)
-			V[0xF] = 0;
-			for (int i = 0; i < (opcode & 0x000F); i++) { // opcode & 0x000F is the height
-				byte mem = memory[I + i];
-				for (int j = 0; j < 8; j++) {
-					byte spriteBit = mem & (0x80 >> j); // ok, horrible naming...
-					if (spriteBit != 0) { // we don't care if it is 0
-						byte screenBitBefore = gfx[(i + V[y]) % SCREEN_HEIGHT][(j + V[x]) % SCREEN_WIDTH];
-						if (screenBitBefore == 1) {
-							V[0xF] = 1;
-						}
-						gfx[(i + V[y] % SCREEN_HEIGHT)][(j + V[x]) % SCREEN_WIDTH] ^= 1;
-					}
-				}
-			}
+			drawSprite(x, y, opcode & 0x000F); // opcode & 0x000F is the height
 			drawFlag = true;
 			pc += 2;
 			break;
@@ -314,31 +525,37 @@ void Chip8::emulateCycle() {
 						pc += 2;
 					break;
 				default:
-					printf("Unknown opcode: 0x%X\n", opcode);
+					fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
 					break;
 			}
 			break;
 		case 0xF000:
 			switch (opcode & 0x00FF) {
 				case 0x0007: // FX07: sets VX to the value of the delay timer
-					V[x] = delay_timer;
+					V[x] = delayTimer();
 					pc += 2;
 					break;
 				case 0x000A: // FX0A: a key press is awaited, and then stored in VX
+					keyWait = true;
                     for (int i = 0; i < 16; i++) {
                         if (keys[i] == 1) {
                             V[x] = i;
                             pc += 2;
+                            keyWait = false;
                             break;
                         }
                     }
 					break;
 				case 0x0015: // FX15: sets the delay timer to VX
 					delay_timer = V[x];
+					delay_timer_start = timerTicks();
 					pc += 2;
 					break;
 				case 0x0018: // FX18: sets the sound timer to VX
+					updateTimers(); // a sound that ran out earlier in the batch still beeps
 					sound_timer = V[x];
+					sound_timer_start = timerTicks();
+					beepPending = sound_timer > 0;
 					pc += 2;
 					break;
 				case 0x001E: // FX1E: adds VX to I
@@ -351,39 +568,715 @@ void Chip8::emulateCycle() {
 					pc += 2;
 					break;
 				case 0x0033: // FX33: stores the Binary-coded decimal representation of VX at the addresses I, I plus 1, and I plus 2
-					memory[I] = V[(opcode & 0x0F00) >> 8] / 100;
-					memory[I + 1] = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
-					memory[I + 2] = (V[(opcode & 0x0F00) >> 8] % 100) % 10;
+					memoryAt(I) = V[(opcode & 0x0F00) >> 8] / 100;
+					memoryAt(I + 1) = (V[(opcode & 0x0F00) >> 8] / 10) % 10;
+					memoryAt(I + 2) = (V[(opcode & 0x0F00) >> 8] % 100) % 10;
 					pc += 2;
 					break;
 				case 0x0055: // FX55: stores V0 to VX in memory starting at address I
 					for (int i = 0; i <= x; i++) {
-						memory[I + i] = V[i];
+						memoryAt(I + i) = V[i];
 					}
 					pc += 2;
 					break;
 				case 0x0065: // FX65: fills V0 to VX with values from memory starting at address I
 					for (int i = 0; i <= x; i++) {
-						V[i] = memory[I + i];
+						V[i] = memoryAt(I + i);
 					}
 					pc += 2;
 					break;
 				default:
-					printf("Unknown opcode: 0x%X\n", opcode);
+					fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
 					break;
 			}
 			break;
 		default:
-			printf("Unknown opcode: 0x%X\n", opcode);
+			fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
+	}
+#endif // C8_DISPATCH_SWITCH
+
+	++cycles;
+}
+
+#endif
+
+#if C8_DISPATCH == C8_DISPATCH_THREADED
+
+void Chip8::emulateCycles(int count) {
+	// One label per handler id, in the order of the Op enum
+	static void* const labels[OP_COUNT] = {
+		&&l_UNDECODED, &&l_Unknown, &&l_Unknown,
+		&&l_00E0, &&l_00EE, &&l_1NNN, &&l_2NNN, &&l_3XNN, &&l_4XNN, &&l_5XY0, &&l_6XNN, &&l_7XNN,
+		&&l_8XY0, &&l_8XY1, &&l_8XY2, &&l_8XY3, &&l_8XY4, &&l_8XY5, &&l_8XY6, &&l_8XY7, &&l_8XYE,
+		&&l_9XY0, &&l_ANNN, &&l_BNNN, &&l_CXNN, &&l_DXYN, &&l_EX9E, &&l_EXA1,
+		&&l_FX07, &&l_FX0A, &&l_FX15, &&l_FX18, &&l_FX1E, &&l_FX29, &&l_FX33, &&l_FX55, &&l_FX65,
+		&&l_3XNN_1NNN, &&l_4XNN_1NNN, &&l_5XY0_1NNN, &&l_9XY0_1NNN, &&l_EX9E_1NNN, &&l_EXA1_1NNN,
+		&&l_6XNN_RUN, &&l_ANNN_DXYN
+	};
+
+	drawFlag = false;
+	keyWait = false;
+	idle = false;
+	if (count <= 0) return;
+	Instr* in;
+
+	// Every handler ends by jumping straight to the next instruction's label
+#define DISPATCH() \
+	if (pc >= MEMORY_SIZE - 1) throw runtime_error("Program counter is out of memory boundary!"); \
+	in = &decoded[pc]; \
+	goto *labels[in->op]
+
+#define HANDLER(name) \
+	l_##name: \
+		opcode = in->opcode; \
+		op##name(*in); \
+		++cycles; \
+		if (--count == 0) goto done; \
+		DISPATCH();
+
+	DISPATCH();
+
+l_UNDECODED:
+	*in = decode(memory[pc] << 8 | memory[pc + 1]);
+#if C8_FUSION
+	fuse(pc);
+#endif
+	goto *labels[in->op];
+
+	HANDLER(Unknown)
+	HANDLER(00E0) HANDLER(00EE) HANDLER(2NNN) HANDLER(3XNN) HANDLER(4XNN)
+	HANDLER(5XY0) HANDLER(6XNN) HANDLER(7XNN)
+	HANDLER(8XY0) HANDLER(8XY1) HANDLER(8XY2) HANDLER(8XY3) HANDLER(8XY4) HANDLER(8XY5)
+	HANDLER(8XY6) HANDLER(8XY7) HANDLER(8XYE)
+	HANDLER(9XY0) HANDLER(ANNN) HANDLER(BNNN) HANDLER(CXNN) HANDLER(DXYN) HANDLER(EX9E) HANDLER(EXA1)
+	HANDLER(FX07) HANDLER(FX15) HANDLER(FX18) HANDLER(FX1E) HANDLER(FX29)
+	HANDLER(FX33) HANDLER(FX55) HANDLER(FX65)
+
+	// A jump that closes an idle loop skips ahead to where the loop can end
+l_1NNN:
+	opcode = in->opcode;
+	op1NNN(*in);
+	++cycles;
+	if (--count == 0) goto done;
+	if (idle) {
+		count -= skipIdle(count);
+		if (count == 0) goto done;
+	}
+	DISPATCH();
+
+	// A key wait ends the batch, there is nothing to run until a key is pressed
+l_FX0A:
+	opcode = in->opcode;
+	opFX0A(*in);
+	++cycles;
+	if (--count == 0 || keyWait) goto done;
+	DISPATCH();
+
+	// A fused instruction runs its instructions back to back and counts each of
+	// them. Without enough cycles left it runs as its first instruction alone.
+
+	// A skip over a jump: either the skip is taken, or the jump runs
+#define SKIP_JUMP(name, cond) \
+	l_##name##_1NNN: \
+		if (count < 2) goto *labels[in->base]; \
+		opcode = in->opcode; \
+		if (cond) { \
+			pc += 4; \
+		} \
+		else { \
+			++cycles; \
+			--count; \
+			opcode = decoded[pc + 2].opcode; \
+			pc = decoded[pc + 2].nnn; \
+		} \
+		++cycles; \
+		if (--count == 0) goto done; \
+		DISPATCH();
+
+	SKIP_JUMP(3XNN, V[in->x] == in->nn)
+	SKIP_JUMP(4XNN, V[in->x] != in->nn)
+	SKIP_JUMP(5XY0, V[in->x] == V[in->y])
+	SKIP_JUMP(9XY0, V[in->x] != V[in->y])
+	SKIP_JUMP(EX9E, keys[V[in->x]] == 1)
+	SKIP_JUMP(EXA1, keys[V[in->x]] == 0)
+
+#undef SKIP_JUMP
+
+l_6XNN_RUN:
+	if (count < in->len) goto *labels[in->base];
+	count -= in->len;
+	cycles += in->len;
+	for (int i = in->len; i > 0; i--) {
+		V[in->x] = in->nn;
+		opcode = in->opcode;
+		pc += 2;
+		in += 2;
+	}
+	if (count == 0) goto done;
+	DISPATCH();
+
+l_ANNN_DXYN:
+	if (count < 2) goto *labels[in->base];
+	I = in->nnn;
+	in += 2;
+	opcode = in->opcode;
+	drawSprite(in->x, in->y, in->n);
+	drawFlag = true;
+	pc += 4;
+	cycles += 2;
+	count -= 2;
+	if (count == 0) goto done;
+	DISPATCH();
+
+#undef HANDLER
+#undef DISPATCH
+
+done:
+	updateTimers();
+}
+
+#else
+
+void Chip8::emulateCycles(int count) {
+	bool drew = false;
+	keyWait = false;
+	for (int i = 0; i < count && !keyWait; i++) {
+		executeCycle();
+		drew |= drawFlag;
+		if (idle) {
+			i += skipIdle(count - i - 1);
+		}
+	}
+	drawFlag = drew;
+	updateTimers();
+}
+
+#endif
+
+Chip8::RunResult Chip8::runCycles(int count) {
+	try {
+		emulateCycles(count);
+	}
+	catch (const exception& e) {
+		error = e.what();
+		return RUN_ERROR;
 	}
+	return keyWait ? RUN_KEY_WAIT : RUN_DONE;
+}
+
+Chip8::RunResult Chip8::runFrame() {
+	// Run up to the first cycle of the next timer tick
+	uint64_t frameEnd = nextTickCycle();
+	RunResult result = runCycles((int)(frameEnd - cycles));
+	if (result == RUN_KEY_WAIT) {
+		// Nothing runs until a key is pressed, the rest of the frame passes idle
+		cycles = frameEnd;
+	}
+	return result == RUN_DONE ? RUN_FRAME : result;
+}
+
+bool Chip8::idleLoop(int target) const {
+	return target == pc || (target + 4 == pc && pollsDelayTimer(target));
+}
+
+bool Chip8::pollsDelayTimer(int addr) const {
+	if (addr + 5 >= MEMORY_SIZE) return false;
+	const byte* m = memory + addr;
+	return (m[0] & 0xF0) == 0xF0 && m[1] == 0x07 &&
+		((m[2] & 0xF0) == 0x30 || (m[2] & 0xF0) == 0x40) && (m[2] & 0x0F) == (m[0] & 0x0F) &&
+		(m[4] << 8 | m[5]) == (0x1000 | addr);
+}
+
+int Chip8::skipIdle(int remaining) {
+	idle = false;
 
-	// Update timers
-	if (delay_timer > 0)
-		--delay_timer;
+	// A jump to itself never sees anything change. A timer poll sees the same
+	// delay timer value, and takes the same branch, until the next tick; once
+	// the timer is at 0 that is forever
+	int length = 1;
+	uint64_t wake = UINT64_MAX;
+	if ((memory[pc] << 8 | memory[pc + 1]) != (0x1000 | pc)) {
+		length = 3;
+		byte value = V[memory[pc] & 0x0F];
+		if (delayTimer() != value) {
+			return 0;
+		}
+		if (value != 0) {
+			wake = nextTickCycle();
+		}
+	}
 
-	if (sound_timer > 0) {
-		if (sound_timer == 1)
-			printf("BEEP!\n");
-		--sound_timer;
+	uint64_t iterations = remaining / length;
+	if (wake != UINT64_MAX && (wake - cycles + length - 1) / length < iterations) {
+		iterations = (wake - cycles + length - 1) / length;
 	}
-}
\ No newline at end of file
+	cycles += iterations * length;
+	return (int)(iterations * length);
+}
+
+// The tables are constant initialized, so a Chip8 used by another unit's
+// static initializer already finds them filled in
+
+const byte Chip8::opTable[16] = {
+	OP_GROUP, OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN, OP_7XNN,
+	OP_GROUP, OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN, OP_GROUP, OP_GROUP
+};
+
+const byte Chip8::op0Table[16] = {
+	OP_00E0,    OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN,
+	OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_00EE,    OP_UNKNOWN
+};
+
+const byte Chip8::op8Table[16] = {
+	OP_8XY0,    OP_8XY1,    OP_8XY2,    OP_8XY3,    OP_8XY4,    OP_8XY5,    OP_8XY6,    OP_8XY7,
+	OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_UNKNOWN, OP_8XYE,    OP_UNKNOWN
+};
+
+// Expands to f(b) to f(b + 0xFF), each followed by a comma
+#define C8_TABLE_1(f, b)   f(b),
+#define C8_TABLE_16(f, b)  C8_TABLE_1(f, b)           C8_TABLE_1(f, (b) + 0x1)   C8_TABLE_1(f, (b) + 0x2)   C8_TABLE_1(f, (b) + 0x3)   \
+                           C8_TABLE_1(f, (b) + 0x4)   C8_TABLE_1(f, (b) + 0x5)   C8_TABLE_1(f, (b) + 0x6)   C8_TABLE_1(f, (b) + 0x7)   \
+                           C8_TABLE_1(f, (b) + 0x8)   C8_TABLE_1(f, (b) + 0x9)   C8_TABLE_1(f, (b) + 0xA)   C8_TABLE_1(f, (b) + 0xB)   \
+                           C8_TABLE_1(f, (b) + 0xC)   C8_TABLE_1(f, (b) + 0xD)   C8_TABLE_1(f, (b) + 0xE)   C8_TABLE_1(f, (b) + 0xF)
+#define C8_TABLE_256(f, b) C8_TABLE_16(f, b)          C8_TABLE_16(f, (b) + 0x10) C8_TABLE_16(f, (b) + 0x20) C8_TABLE_16(f, (b) + 0x30) \
+                           C8_TABLE_16(f, (b) + 0x40) C8_TABLE_16(f, (b) + 0x50) C8_TABLE_16(f, (b) + 0x60) C8_TABLE_16(f, (b) + 0x70) \
+                           C8_TABLE_16(f, (b) + 0x80) C8_TABLE_16(f, (b) + 0x90) C8_TABLE_16(f, (b) + 0xA0) C8_TABLE_16(f, (b) + 0xB0) \
+                           C8_TABLE_16(f, (b) + 0xC0) C8_TABLE_16(f, (b) + 0xD0) C8_TABLE_16(f, (b) + 0xE0) C8_TABLE_16(f, (b) + 0xF0)
+
+// The handler id of EXNN and FXNN for the low byte nn
+#define C8_OP_E(nn) \
+	((nn) == 0x9E ? OP_EX9E : (nn) == 0xA1 ? OP_EXA1 : OP_UNKNOWN)
+#define C8_OP_F(nn) \
+	((nn) == 0x07 ? OP_FX07 : (nn) == 0x0A ? OP_FX0A : (nn) == 0x15 ? OP_FX15 : \
+	 (nn) == 0x18 ? OP_FX18 : (nn) == 0x1E ? OP_FX1E : (nn) == 0x29 ? OP_FX29 : \
+	 (nn) == 0x33 ? OP_FX33 : (nn) == 0x55 ? OP_FX55 : (nn) == 0x65 ? OP_FX65 : OP_UNKNOWN)
+
+const byte Chip8::opETable[256] = { C8_TABLE_256(C8_OP_E, 0x00) };
+const byte Chip8::opFTable[256] = { C8_TABLE_256(C8_OP_F, 0x00) };
+
+#undef C8_OP_F
+#undef C8_OP_E
+#undef C8_TABLE_256
+#undef C8_TABLE_16
+#undef C8_TABLE_1
+
+Chip8::Instr Chip8::decode(u_short opcode) {
+	Instr in;
+	in.opcode = opcode;
+	in.x      = (opcode & 0x0F00) >> 8;
+	in.y      = (opcode & 0x00F0) >> 4;
+	in.n      =  opcode & 0x000F;
+	in.nn     =  opcode & 0x00FF;
+	in.nnn    =  opcode & 0x0FFF;
+
+	in.op = opTable[opcode >> 12];
+	if (in.op == OP_GROUP) {
+		switch (opcode >> 12) {
+			case 0x0: in.op = op0Table[in.n];  break;
+			case 0x8: in.op = op8Table[in.n];  break;
+			case 0xE: in.op = opETable[in.nn]; break;
+			case 0xF: in.op = opFTable[in.nn]; break;
+		}
+	}
+	in.base = in.op;
+	in.len  = 1;
+	return in;
+}
+
+void Chip8::fuse(int addr) {
+	// The fused handlers read the fields of the slots after addr. Those are
+	// decoded here but stay OP_UNDECODED, so each of them is fused in turn
+	// when it first runs, a jump into the middle of a pattern included
+	const int end = addr + 2 * MAX_FUSED_LENGTH < MEMORY_SIZE - 1 ? addr + 2 * MAX_FUSED_LENGTH : MEMORY_SIZE - 1;
+	for (int a = addr + 2; a < end; a += 2) {
+		if (decoded[a].op != OP_UNDECODED) continue;
+		decoded[a] = decode(memory[a] << 8 | memory[a + 1]);
+		decoded[a].op = OP_UNDECODED;
+	}
+	if (addr + 2 >= end) return;
+
+	Instr& in = decoded[addr];
+	byte next = decoded[addr + 2].base;
+	// The jump closing a delay timer poll has to run on its own, see l_1NNN
+	if (addr >= 2 && pollsDelayTimer(addr - 2)) return;
+	switch (in.op) {
+		case OP_3XNN: if (next == OP_1NNN) in.op = OP_3XNN_1NNN; break;
+		case OP_4XNN: if (next == OP_1NNN) in.op = OP_4XNN_1NNN; break;
+		case OP_5XY0: if (next == OP_1NNN) in.op = OP_5XY0_1NNN; break;
+		case OP_9XY0: if (next == OP_1NNN) in.op = OP_9XY0_1NNN; break;
+		case OP_EX9E: if (next == OP_1NNN) in.op = OP_EX9E_1NNN; break;
+		case OP_EXA1: if (next == OP_1NNN) in.op = OP_EXA1_1NNN; break;
+		case OP_ANNN: if (next == OP_DXYN) in.op = OP_ANNN_DXYN; break;
+		case OP_6XNN: {
+			int len = 1;
+			while (addr + 2 * len < end && decoded[addr + 2 * len].base == OP_6XNN) len++;
+			if (len > 1) {
+				in.op  = OP_6XNN_RUN;
+				in.len = len;
+			}
+			break;
+		}
+	}
+	if (in.op != in.base && in.op != OP_6XNN_RUN) {
+		in.len = 2;
+	}
+}
+
+void Chip8::invalidateDecoded(int addr, int len) {
+	addr &= MEMORY_SIZE - 1;
+	if (addr + len > MEMORY_SIZE) {
+		// Wrapped around the end, the start of memory was written too
+		invalidateDecoded(0, addr + len - MEMORY_SIZE);
+		len = MEMORY_SIZE - addr;
+	}
+	// An instruction starting one byte before addr also reads it
+	int first = addr > 0 ? addr - 1 : 0;
+	int last  = addr + len < MEMORY_SIZE ? addr + len : MEMORY_SIZE;
+	for (int i = first; i < last; i++) {
+		decoded[i].op = OP_UNDECODED;
+	}
+	// A fused one may start up to MAX_FUSED_LENGTH instructions before, but
+	// only those that reach addr have to go. Data written just past the code
+	// leaves the plain instructions before it alone
+	int fusedFirst = addr > 2 * MAX_FUSED_LENGTH - 1 ? addr - (2 * MAX_FUSED_LENGTH - 1) : 0;
+	for (int i = fusedFirst; i < first; i++) {
+		Instr& in = decoded[i];
+		if (in.op != OP_UNDECODED && in.op != in.base && i + 2 * in.len > addr) {
+			in.op = OP_UNDECODED;
+		}
+	}
+}
+
+void Chip8::flushDecodeCache() {
+	memset(decoded, 0, sizeof(decoded));
+}
+
+void Chip8::opUnknown(const Instr& in) {
+	fprintf(stderr, "Unknown opcode: 0x%X\n", in.opcode);
+}
+
+// 00E0: clears the screen
+void Chip8::op00E0(const Instr&) {
+	clearScreen();
+	drawFlag = true;
+	pc += 2;
+}
+
+// 00EE: returns from subroutine
+void Chip8::op00EE(const Instr&) {
+	if (sp == 0) throw runtime_error("Stack underflow!");
+	pc = stack[--sp];
+	stack[sp] = 0;
+	pc += 2;
+}
+
+// 1NNN: jumps to address NNN
+void Chip8::op1NNN(const Instr& in) {
+	if (in.nnn <= pc) {
+		idle = idleLoop(in.nnn);
+	}
+	pc = in.nnn;
+}
+
+// 2NNN: calls the subroutine at address NNN
+void Chip8::op2NNN(const Instr& in) {
+	if (sp >= NUM_LEVEL_STACK) throw runtime_error("Stack overflow!");
+	stack[sp] = pc;
+	++sp;
+	pc = in.nnn;
+}
+
+// 3XNN: skips the next instruction if VX equals NN
+void Chip8::op3XNN(const Instr& in) {
+	pc += (V[in.x] == in.nn) ? 4 : 2;
+}
+
+// 4XNN: skips the next instruction if VX doesn't equal NN
+void Chip8::op4XNN(const Instr& in) {
+	pc += (V[in.x] != in.nn) ? 4 : 2;
+}
+
+// 5XY0: skips the next instruction if VX equals VY
+void Chip8::op5XY0(const Instr& in) {
+	pc += (V[in.x] == V[in.y]) ? 4 : 2;
+}
+
+// 6XNN: sets VX to NN
+void Chip8::op6XNN(const Instr& in) {
+	V[in.x] = in.nn;
+	pc += 2;
+}
+
+// 7XNN: adds NN to VX
+void Chip8::op7XNN(const Instr& in) {
+	V[in.x] += in.nn;
+	pc += 2;
+}
+
+// 8XY0: sets VX to the value of VY
+void Chip8::op8XY0(const Instr& in) {
+	V[in.x] = V[in.y];
+	pc += 2;
+}
+
+// 8XY1: sets VX to VX or VY
+void Chip8::op8XY1(const Instr& in) {
+	V[in.x] |= V[in.y];
+	pc += 2;
+}
+
+// 8XY2: sets VX to VX and VY
+void Chip8::op8XY2(const Instr& in) {
+	V[in.x] &= V[in.y];
+	pc += 2;
+}
+
+// 8XY3: sets VX to VX xor VY
+void Chip8::op8XY3(const Instr& in) {
+	V[in.x] ^= V[in.y];
+	pc += 2;
+}
+
+// 8XY4: adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't
+void Chip8::op8XY4(const Instr& in) {
+	V[0xF] = (V[in.x] + V[in.y] > 0xFF) ? 1 : 0;
+	V[in.x] += V[in.y];
+	pc += 2;
+}
+
+// 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't
+void Chip8::op8XY5(const Instr& in) {
+	V[0xF] = (V[in.x] >= V[in.y]) ? 1 : 0;
+	V[in.x] -= V[in.y];
+	pc += 2;
+}
+
+// 8XY6: shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift
+void Chip8::op8XY6(const Instr& in) {
+	V[0xF] = V[in.x] & 0x01;
+	V[in.x] >>= 1;
+	pc += 2;
+}
+
+// 8XY7: sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't
+void Chip8::op8XY7(const Instr& in) {
+	V[0xF] = V[in.y] >= V[in.x] ? 1 : 0;
+	V[in.x] = V[in.y] - V[in.x];
+	pc += 2;
+}
+
+// 8XYE: shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift
+void Chip8::op8XYE(const Instr& in) {
+	V[0xF] = V[in.x] & 0x80;
+	V[in.x] <<= 1;
+	pc += 2;
+}
+
+// 9XY0: skips the next instruction if VX doesn't equal VY
+void Chip8::op9XY0(const Instr& in) {
+	pc += (V[in.x] != V[in.y]) ? 4 : 2;
+}
+
+// ANNN: sets I to the address NNN
+void Chip8::opANNN(const Instr& in) {
+	I = in.nnn;
+	pc += 2;
+}
+
+// BNNN: jumps to the address NNN plus V0
+void Chip8::opBNNN(const Instr& in) {
+	pc = in.nnn + V[0];
+}
+
+// CXNN: sets VX to a random number and NN
+void Chip8::opCXNN(const Instr& in) {
+	V[in.x] = in.nn & rng.next();
+	pc += 2;
+}
+
+// DXYN: draws an N rows high sprite from memory[I] at (VX, VY), see drawSprite
+void Chip8::opDXYN(const Instr& in) {
+	drawSprite(in.x, in.y, in.n);
+	drawFlag = true;
+	pc += 2;
+}
+
+// EX9E: skips the next instruction if the key stored in VX is pressed
+void Chip8::opEX9E(const Instr& in) {
+	pc += (keys[V[in.x]] == 1) ? 4 : 2;
+}
+
+// EXA1: skips the next instruction if the key stored in VX isn't pressed
+void Chip8::opEXA1(const Instr& in) {
+	pc += (keys[V[in.x]] == 0) ? 4 : 2;
+}
+
+// FX07: sets VX to the value of the delay timer
+void Chip8::opFX07(const Instr& in) {
+	V[in.x] = delayTimer();
+	pc += 2;
+}
+
+// FX0A: a key press is awaited, and then stored in VX
+void Chip8::opFX0A(const Instr& in) {
+	keyWait = true;
+	for (int i = 0; i < 16; i++) {
+		if (keys[i] == 1) {
+			V[in.x] = i;
+			pc += 2;
+			keyWait = false;
+			break;
+		}
+	}
+}
+
+// FX15: sets the delay timer to VX
+void Chip8::opFX15(const Instr& in) {
+	delay_timer = V[in.x];
+	delay_timer_start = timerTicks();
+	pc += 2;
+}
+
+// FX18: sets the sound timer to VX
+void Chip8::opFX18(const Instr& in) {
+	// A sound that ran out earlier in the batch still beeps
+	updateTimers();
+	sound_timer = V[in.x];
+	sound_timer_start = timerTicks();
+	beepPending = sound_timer > 0;
+	pc += 2;
+}
+
+// FX1E: adds VX to I
+void Chip8::opFX1E(const Instr& in) {
+	V[0xF] = (I + V[in.x] > 0xFFF) ? 1 : 0;
+	I += V[in.x];
+	pc += 2;
+}
+
+// FX29: sets I to the location of the sprite for the character in VX
+void Chip8::opFX29(const Instr& in) {
+	I = 5 * V[in.x];
+	pc += 2;
+}
+
+// FX33: stores the Binary-coded decimal representation of VX at the addresses I, I plus 1, and I plus 2
+void Chip8::opFX33(const Instr& in) {
+	byte vx = V[in.x];
+	memoryAt(I)     = vx / 100;
+	memoryAt(I + 1) = (vx / 10) % 10;
+	memoryAt(I + 2) = vx % 10;
+	invalidateDecoded(I, 3);
+	pc += 2;
+}
+
+// FX55: stores V0 to VX in memory starting at address I
+void Chip8::opFX55(const Instr& in) {
+	for (int i = 0; i <= in.x; i++) {
+		memoryAt(I + i) = V[i];
+	}
+	invalidateDecoded(I, in.x + 1);
+	pc += 2;
+}
+
+// FX65: fills V0 to VX with values from memory starting at address I
+void Chip8::opFX65(const Instr& in) {
+	for (int i = 0; i <= in.x; i++) {
+		V[i] = memoryAt(I + i);
+	}
+	pc += 2;
+}
+
+#if C8_DISPATCH == C8_DISPATCH_SPECIALIZED
+
+template <u_short OPCODE>
+void Chip8::opSpecialized(Chip8& c) {
+	// The fields are constants, so once the handler is inlined nothing is extracted at run time
+	const Instr in = {
+		OPCODE, OPCODE & 0x0FFF, OP_UNDECODED, OP_UNDECODED, 1,
+		(OPCODE & 0x0F00) >> 8, (OPCODE & 0x00F0) >> 4, OPCODE & 0x000F, OPCODE & 0x00FF
+	};
+
+	switch (OPCODE & 0xF000) {
+		case 0x0000:
+			switch (OPCODE & 0x000F) {
+				case 0x0: c.op00E0(in); return;
+				case 0xE: c.op00EE(in); return;
+			}
+			break;
+		case 0x1000: c.op1NNN(in); return;
+		case 0x2000: c.op2NNN(in); return;
+		case 0x3000: c.op3XNN(in); return;
+		case 0x4000: c.op4XNN(in); return;
+		case 0x5000: c.op5XY0(in); return;
+		case 0x6000: c.op6XNN(in); return;
+		case 0x7000: c.op7XNN(in); return;
+		case 0x8000:
+			switch (OPCODE & 0x000F) {
+				case 0x0: c.op8XY0(in); return;
+				case 0x1: c.op8XY1(in); return;
+				case 0x2: c.op8XY2(in); return;
+				case 0x3: c.op8XY3(in); return;
+				case 0x4: c.op8XY4(in); return;
+				case 0x5: c.op8XY5(in); return;
+				case 0x6: c.op8XY6(in); return;
+				case 0x7: c.op8XY7(in); return;
+				case 0xE: c.op8XYE(in); return;
+			}
+			break;
+		case 0x9000: c.op9XY0(in); return;
+		case 0xA000: c.opANNN(in); return;
+		case 0xB000: c.opBNNN(in); return;
+		case 0xC000: c.opCXNN(in); return;
+		case 0xD000: c.opDXYN(in); return;
+		case 0xE000:
+			switch (OPCODE & 0x00FF) {
+				case 0x9E: c.opEX9E(in); return;
+				case 0xA1: c.opEXA1(in); return;
+			}
+			break;
+		case 0xF000:
+			switch (OPCODE & 0x00FF) {
+				case 0x07: c.opFX07(in); return;
+				case 0x0A: c.opFX0A(in); return;
+				case 0x15: c.opFX15(in); return;
+				case 0x18: c.opFX18(in); return;
+				case 0x1E: c.opFX1E(in); return;
+				case 0x29: c.opFX29(in); return;
+				case 0x33: c.opFX33(in); return;
+				case 0x55: c.opFX55(in); return;
+				case 0x65: c.opFX65(in); return;
+			}
+			break;
+	}
+	c.opUnknown(in);
+}
+
+// Expands to the handlers for opcodes b to b + 0xFFFF, 16 at a time
+#define C8_SPEC_1(b)     &Chip8::opSpecialized<(b)>,
+#define C8_SPEC_16(b)    C8_SPEC_1(b)            C8_SPEC_1((b) + 0x1)    C8_SPEC_1((b) + 0x2)    C8_SPEC_1((b) + 0x3)    \
+                         C8_SPEC_1((b) + 0x4)    C8_SPEC_1((b) + 0x5)    C8_SPEC_1((b) + 0x6)    C8_SPEC_1((b) + 0x7)    \
+                         C8_SPEC_1((b) + 0x8)    C8_SPEC_1((b) + 0x9)    C8_SPEC_1((b) + 0xA)    C8_SPEC_1((b) + 0xB)    \
+                         C8_SPEC_1((b) + 0xC)    C8_SPEC_1((b) + 0xD)    C8_SPEC_1((b) + 0xE)    C8_SPEC_1((b) + 0xF)
+#define C8_SPEC_256(b)   C8_SPEC_16(b)           C8_SPEC_16((b) + 0x10)  C8_SPEC_16((b) + 0x20)  C8_SPEC_16((b) + 0x30)  \
+                         C8_SPEC_16((b) + 0x40)  C8_SPEC_16((b) + 0x50)  C8_SPEC_16((b) + 0x60)  C8_SPEC_16((b) + 0x70)  \
+                         C8_SPEC_16((b) + 0x80)  C8_SPEC_16((b) + 0x90)  C8_SPEC_16((b) + 0xA0)  C8_SPEC_16((b) + 0xB0)  \
+                         C8_SPEC_16((b) + 0xC0)  C8_SPEC_16((b) + 0xD0)  C8_SPEC_16((b) + 0xE0)  C8_SPEC_16((b) + 0xF0)
+#define C8_SPEC_4096(b)  C8_SPEC_256(b)          C8_SPEC_256((b) + 0x100) C8_SPEC_256((b) + 0x200) C8_SPEC_256((b) + 0x300) \
+                         C8_SPEC_256((b) + 0x400) C8_SPEC_256((b) + 0x500) C8_SPEC_256((b) + 0x600) C8_SPEC_256((b) + 0x700) \
+                         C8_SPEC_256((b) + 0x800) C8_SPEC_256((b) + 0x900) C8_SPEC_256((b) + 0xA00) C8_SPEC_256((b) + 0xB00) \
+                         C8_SPEC_256((b) + 0xC00) C8_SPEC_256((b) + 0xD00) C8_SPEC_256((b) + 0xE00) C8_SPEC_256((b) + 0xF00)
+
+const Chip8::SpecializedHandler Chip8::specializedHandlers[0x10000] = {
+	C8_SPEC_4096(0x0000) C8_SPEC_4096(0x1000) C8_SPEC_4096(0x2000) C8_SPEC_4096(0x3000)
+	C8_SPEC_4096(0x4000) C8_SPEC_4096(0x5000) C8_SPEC_4096(0x6000) C8_SPEC_4096(0x7000)
+	C8_SPEC_4096(0x8000) C8_SPEC_4096(0x9000) C8_SPEC_4096(0xA000) C8_SPEC_4096(0xB000)
+	C8_SPEC_4096(0xC000) C8_SPEC_4096(0xD000) C8_SPEC_4096(0xE000) C8_SPEC_4096(0xF000)
+};
+
+#undef C8_SPEC_4096
+#undef C8_SPEC_256
+#undef C8_SPEC_16
+#undef C8_SPEC_1
+
+#endif
@@ -1,10 +1,33 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
+#include "random.h"
 
 using byte    = unsigned char;
 using u_short = unsigned short;
 
-union SDL_Event;
+/* Opcode dispatch engines, pick one at build time by defining C8_DISPATCH */
+#define C8_DISPATCH_SWITCH 0 // nested switch on the opcode nibbles
+#define C8_DISPATCH_TABLE  1 // decode tables fill a predecode cache, a switch on the cached handler id
+#define C8_DISPATCH_THREADED 2 // computed goto between handlers, GCC/Clang only
+#define C8_DISPATCH_SPECIALIZED 3 // one handler per opcode value, operands are template constants
+
+#ifndef C8_DISPATCH
+#define C8_DISPATCH C8_DISPATCH_SWITCH
+#endif
+
+/* Superinstruction fusion in the threaded engine, define C8_FUSION to 0 to turn it off */
+#ifndef C8_FUSION
+#define C8_FUSION 1
+#endif
+
+/* Labels as values are a GNU extension, other compilers get the portable switch */
+#if C8_DISPATCH == C8_DISPATCH_THREADED && !defined(__GNUC__)
+#undef C8_DISPATCH
+#define C8_DISPATCH C8_DISPATCH_SWITCH
+#endif
 
 class Chip8 {
 public:
@@ -16,8 +39,8 @@ public:
 	static const int SCREEN_WIDTH    = 64;
 	static const int SCREEN_HEIGHT   = 32;
 	static const int PROGRAM_START_LOC = 0x200;
-
-    std::string gameName;
+	static const int TIMER_FREQUENCY   = 60;
+	static const int DEFAULT_CYCLES_PER_SECOND = 600;
 
 	u_short opcode;
 
@@ -33,14 +56,24 @@ public:
 	/* Program counter */
 	u_short pc;
 
-	/* Pixel state map representing our screen. Each pixel is a byte in our map (not a bit) */
-	byte gfx[SCREEN_HEIGHT][SCREEN_WIDTH];
+	/* Pixel state map representing our screen. Each row is one 64 bit word, the
+	   most significant bit is the leftmost pixel */
+	uint64_t gfx[SCREEN_HEIGHT];
 
-	/* The delay timer */
+	/* The delay timer as set by FX15 at timer tick delay_timer_start. It counts
+	   down lazily, read the current value through delayTimer() */
 	byte delay_timer;
+	uint64_t delay_timer_start;
 
-	/* The sound timer */
+	/* The sound timer as set by FX18 at timer tick sound_timer_start, read the
+	   current value through soundTimer() */
 	byte sound_timer;
+	uint64_t sound_timer_start;
+
+	/* Instructions executed since initialize, the timers tick every
+	   cyclesPerSecond / TIMER_FREQUENCY of them */
+	uint64_t cycles;
+	int cyclesPerSecond;
 
 	/* The stack */
 	u_short stack[NUM_LEVEL_STACK];
@@ -51,22 +84,283 @@ public:
 	/* Keypad, holds the keys' state */
 	byte keys[16];
 
-	/* Draw flag, set to true if we need to draw in the current cycle */
+	/* Random numbers for CXNN. initialize reseeds it with Random::DEFAULT_SEED,
+	   seed it afterwards for a different sequence */
+	Random rng;
+
+	/* Draw flag, set to true if we need to draw in the current cycle (or batch) */
 	bool drawFlag;
 
+	/* Set when the sound timer runs out, the front end plays the beep and clears it */
+	bool beep;
+
+	/* Why runCycles or runFrame returned */
+	enum RunResult {
+		RUN_DONE,     // ran every cycle asked for
+		RUN_FRAME,    // reached the next 60 Hz timer tick
+		RUN_KEY_WAIT, // FX0A is waiting for a key press
+		RUN_ERROR     // see error
+	};
+
+	/* What stopped the last run with RUN_ERROR */
+	std::string error;
+
 	/* Initialize the system */
 	void initialize();
 
+	/* Set how many instructions make up one emulated second, which paces the timers */
+	void setCyclesPerSecond(int rate);
+
+	/* Current values of the timers */
+	byte delayTimer() const;
+	byte soundTimer() const;
+
+	/* Set beep if the sound timer ran out, called once after each run of instructions */
+	void updateTimers();
+
 	/* Emulate one CPU cycle */
 	void emulateCycle();
 
-	/* Load the game into memory */
-	void loadGame();
+	/* Emulate count CPU cycles, drawFlag is set if any of them drew. Stops
+	   early when FX0A waits for a key. Loops that only wait, a jump to itself
+	   or a delay timer poll, are passed over in one step up to the next timer
+	   tick, ending in the same state as running them */
+	void emulateCycles(int count);
+
+	/* Emulate up to count cycles, reporting errors instead of throwing */
+	RunResult runCycles(int count);
+
+	/* Emulate up to the next timer tick. A key wait lets the rest of the frame
+	   pass without running anything */
+	RunResult runFrame();
 
-	/* Handle key event */
-	void handleKey(const SDL_Event& e);
+	/* Copy a ROM image to the program area, returns false with error set if it doesn't fit */
+	bool loadRom(const byte* data, size_t size);
+
+	/* Load a ROM file into memory, returns false with error set if it can't be read */
+	bool loadGame(const std::string& fileName);
+
+	/* Read a ROM file for loadRom, returns false with error set if it can't be opened */
+	static bool readRom(const std::string& fileName, std::vector<byte>& image, std::string& error);
+
+	/* Press or release one of the 16 keys */
+	void setKey(int key, bool pressed) {
+		keys[key & 0xF] = pressed ? 1 : 0;
+	}
 
 	/* Clear the mem-mapped screen */
 	void clearScreen();
+
+	/* The screen rows, SCREEN_HEIGHT words laid out as in gfx */
+	const uint64_t* framebuffer() const { return gfx; }
+
+	/* Whether the pixel at column x, row y is lit */
+	bool pixel(int x, int y) const {
+		return ((gfx[y] >> (SCREEN_WIDTH - 1 - x)) & 1) != 0;
+	}
+
+	/* Rows changed since the last clearDirtyRows, bit i is row i */
+	uint32_t dirtyRows() const { return dirty; }
+
+	/* Whether row y changed since the last clearDirtyRows */
+	bool rowDirty(int y) const { return ((dirty >> y) & 1) != 0; }
+
+	/* Mark every row as presented */
+	void clearDirtyRows() { dirty = 0; }
+
+	/* Drop all predecoded instructions, needed after writing to memory directly */
+	void flushDecodeCache();
+
+	/* The whole machine as plain data, everything but the decode cache. Fields
+	   are ordered by size so the layout has no holes */
+	struct State {
+		uint64_t gfx[SCREEN_HEIGHT];
+		uint64_t delayTimerStart;
+		uint64_t soundTimerStart;
+		uint64_t cycles;
+		uint64_t rngState;
+		int32_t cyclesPerSecond;
+		uint32_t dirty;
+		u_short stack[NUM_LEVEL_STACK];
+		u_short sp;
+		u_short I;
+		u_short pc;
+		u_short opcode;
+		byte memory[MEMORY_SIZE];
+		byte V[NUM_REGISTERS];
+		byte keys[16];
+		byte delayTimer;
+		byte soundTimer;
+		byte drawFlag;
+		byte beep;
+		byte beepPending;
+		byte keyWait;
+		byte reserved[10];
+	};
+	static_assert(sizeof(State) == 4480, "State is the file format, keep it free of padding");
+
+	/* Bumped whenever State changes, files of another version are refused */
+	static const uint32_t STATE_VERSION = 1;
+
+	/* Capture the machine into state, a handful of memcpys */
+	void saveState(State& state) const;
+
+	/* Restore a captured machine. Only the decode cache entries of memory that
+	   differs are dropped, so going back a few frames stays cheap. A Jit has to
+	   be reset afterwards, as after loading a new game */
+	void loadState(const State& state);
+
+	/* The same through a file: a small header (magic, STATE_VERSION, size of
+	   State) followed by State as laid out in memory, so files move between
+	   little endian hosts. Return false with error set on failure, loadState
+	   also when the rate, sp or pc are out of range */
+	bool saveState(const std::string& fileName);
+	bool loadState(const std::string& fileName);
 private:
+	/* The recompiler runs blocks in place of the interpreter loop */
+	friend class Jit;
+
+	/* The lockstep interpreter copies whole machines in and out of its lanes */
+	friend class Lockstep;
+
+	/* Handler ids, OP_UNDECODED marks an empty decode cache slot */
+	enum Op : byte {
+		OP_UNDECODED, OP_GROUP, OP_UNKNOWN,
+		OP_00E0, OP_00EE, OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN, OP_7XNN,
+		OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7, OP_8XYE,
+		OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN, OP_EX9E, OP_EXA1,
+		OP_FX07, OP_FX0A, OP_FX15, OP_FX18, OP_FX1E, OP_FX29, OP_FX33, OP_FX55, OP_FX65,
+		// Fused instructions, only produced by fuse()
+		OP_3XNN_1NNN, OP_4XNN_1NNN, OP_5XY0_1NNN, OP_9XY0_1NNN, OP_EX9E_1NNN, OP_EXA1_1NNN,
+		OP_6XNN_RUN, OP_ANNN_DXYN,
+		OP_COUNT
+	};
+
+	/* Longest run of instructions a fused one covers */
+	static const int MAX_FUSED_LENGTH = 8;
+
+	/* A predecoded instruction: its handler id plus every operand field. A fused
+	   instruction keeps the fields of its first instruction, base is that
+	   instruction's own handler id and len the number of instructions covered */
+	struct Instr {
+		u_short opcode;
+		u_short nnn;
+		byte op;
+		byte base;
+		byte len;
+		byte x;
+		byte y;
+		byte n;
+		byte nn;
+	};
+
+	/* Decode tables: the main one is indexed by the top nibble of the opcode,
+	   the group ones by the low nibble (0x0, 0x8) or the low byte (0xE, 0xF) */
+	static const byte opTable[16];
+	static const byte op0Table[16];
+	static const byte op8Table[16];
+	static const byte opETable[256];
+	static const byte opFTable[256];
+
+	typedef void (*SpecializedHandler)(Chip8& chip8);
+
+	/* Handlers indexed by the whole opcode, only built for C8_DISPATCH_SPECIALIZED */
+	static const SpecializedHandler specializedHandlers[0x10000];
+
+	/* The handler for one opcode value, every operand field is a constant */
+	template <u_short OPCODE> static void opSpecialized(Chip8& chip8);
+
+	/* Rows changed since the last present, one bit per row */
+	uint32_t dirty;
+	static_assert(SCREEN_HEIGHT <= 32, "dirty row mask too small");
+
+	/* Predecoded program, one slot per address since pc may be odd. Filled lazily
+	   and invalidated by the opcodes that write to memory (FX33, FX55) */
+	Instr decoded[MEMORY_SIZE];
+
+	/* Decode an opcode through the decode tables */
+	static Instr decode(u_short opcode);
+
+	/* Replace the instruction predecoded at addr by a fused one if it starts a known idiom */
+	void fuse(int addr);
+
+	/* Drop the predecoded instructions overlapping memory[addr, addr + len) */
+	void invalidateDecoded(int addr, int len);
+
+	/* Set while the sound timer runs, to beep once when it reaches zero */
+	bool beepPending;
+
+	/* Set when the last FX0A found no key pressed */
+	bool keyWait;
+
+	/* Set when the last 1NNN closed a loop that only waits, see idleLoop */
+	bool idle;
+
+	/* Whether a jump from pc back to target closes a loop that does nothing
+	   but wait: a jump to itself, or a delay timer poll */
+	bool idleLoop(int target) const;
+
+	/* Whether addr holds FX07, then 3XNN or 4XNN on the same VX, then a jump
+	   back to addr: a loop that waits for the delay timer to reach a value */
+	bool pollsDelayTimer(int addr) const;
+
+	/* Run up to remaining cycles of the idle loop at pc at once, stopping
+	   where the loop would first see the delay timer change. Returns the
+	   cycles skipped, whole iterations of the loop only */
+	int skipIdle(int remaining);
+
+	/* emulateCycle without the timer update, emulateCycles updates the timers
+	   once after the whole batch. The threaded engine has its own loop */
+	void executeCycle();
+
+	/* Timer ticks elapsed since initialize */
+	uint64_t timerTicks() const;
+
+	/* The first cycle of the next timer tick */
+	uint64_t nextTickCycle() const;
+
+	/* Memory at addr, wrapped into the 4 KB address space since I and the bytes
+	   after it can point anywhere up to 0xFFFF + 15 */
+	byte& memoryAt(int addr) { return memory[addr & (MEMORY_SIZE - 1)]; }
+	static_assert((MEMORY_SIZE & (MEMORY_SIZE - 1)) == 0, "addresses are wrapped with a mask");
+
+	/* Draw a sprite of the given height from memory[I] at (VX, VY), sets VF on collision */
+	void drawSprite(byte x, byte y, byte height);
+
+	/* Opcode handlers, operands come predecoded in the instruction */
+	void opUnknown(const Instr& in);
+	void op00E0(const Instr& in);
+	void op00EE(const Instr& in);
+	void op1NNN(const Instr& in);
+	void op2NNN(const Instr& in);
+	void op3XNN(const Instr& in);
+	void op4XNN(const Instr& in);
+	void op5XY0(const Instr& in);
+	void op6XNN(const Instr& in);
+	void op7XNN(const Instr& in);
+	void op8XY0(const Instr& in);
+	void op8XY1(const Instr& in);
+	void op8XY2(const Instr& in);
+	void op8XY3(const Instr& in);
+	void op8XY4(const Instr& in);
+	void op8XY5(const Instr& in);
+	void op8XY6(const Instr& in);
+	void op8XY7(const Instr& in);
+	void op8XYE(const Instr& in);
+	void op9XY0(const Instr& in);
+	void opANNN(const Instr& in);
+	void opBNNN(const Instr& in);
+	void opCXNN(const Instr& in);
+	void opDXYN(const Instr& in);
+	void opEX9E(const Instr& in);
+	void opEXA1(const Instr& in);
+	void opFX07(const Instr& in);
+	void opFX0A(const Instr& in);
+	void opFX15(const Instr& in);
+	void opFX18(const Instr& in);
+	void opFX1E(const Instr& in);
+	void opFX29(const Instr& in);
+	void opFX33(const Instr& in);
+	void opFX55(const Instr& in);
+	void opFX65(const Instr& in);
 };
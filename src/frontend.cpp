@@ -0,0 +1,137 @@
+#include "stdafx.h"
+#include <string.h>
+#include "frontend.h"
+
+KeyMap::KeyMap() {
+	// The keypad's 4x4 grid on the left hand block of the keyboard
+	static const SDL_Scancode grid[16] = {
+		SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
+		SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
+		SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
+		SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V
+	};
+	static const int keypad[16] = {
+		0x1, 0x2, 0x3, 0xC,
+		0x4, 0x5, 0x6, 0xD,
+		0x7, 0x8, 0x9, 0xE,
+		0xA, 0x0, 0xB, 0xF
+	};
+	clear();
+	for (int i = 0; i < 16; i++) {
+		map(grid[i], keypad[i]);
+	}
+}
+
+void KeyMap::clear() {
+	memset(keys, -1, sizeof(keys));
+}
+
+const KeyMap defaultKeyMap;
+
+void handleKey(Chip8& chip8, const SDL_Event& e, const KeyMap& keyMap) {
+	// Presses and releases take the same lookup
+	if (e.type != SDL_KEYDOWN && e.type != SDL_KEYUP) {
+		return;
+	}
+	int key = keyMap.key(e.key.keysym.scancode);
+	if (key >= 0) {
+		chip8.setKey(key, e.type == SDL_KEYDOWN);
+	}
+}
+
+Screen::Screen(SDL_Renderer* renderer) : renderer(renderer), stale(true) {
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+		Chip8::SCREEN_WIDTH, Chip8::SCREEN_HEIGHT);
+}
+
+Screen::~Screen() {
+	if (texture != NULL) {
+		SDL_DestroyTexture(texture);
+	}
+}
+
+void drawGraphics(const Chip8& chip8, Screen& screen) {
+	// Expand only the rows that changed since the last frame, or all of them
+	// the first time since pixels don't hold this machine's screen yet
+	for (int i = 0; i < chip8.SCREEN_HEIGHT; i++) {
+		if (!screen.stale && !chip8.rowDirty(i)) {
+			continue;
+		}
+		for (int j = 0; j < chip8.SCREEN_WIDTH; j++) {
+			screen.pixels[i][j] = chip8.pixel(j, i) ? 0xFFFFFFFF : 0xFF000000;
+		}
+	}
+	screen.stale = false;
+
+	// Upload the whole screen once and let SDL scale it to the window
+	SDL_UpdateTexture(screen.texture, NULL, screen.pixels, sizeof(screen.pixels[0]));
+	SDL_RenderClear(screen.renderer);
+	SDL_RenderCopy(screen.renderer, screen.texture, NULL, NULL);
+	SDL_RenderPresent(screen.renderer);
+}
+
+FramePacer::FramePacer(int fps) {
+	frequency = SDL_GetPerformanceFrequency();
+	period = frequency / fps;
+	start = SDL_GetPerformanceCounter();
+	deadline = start + period;
+	minSpin = frequency / 5000; // 200 us
+	maxSpin = frequency / 1000;
+	spinMargin = maxSpin;
+	oversleep = 0;
+	count = 0;
+	lateTotal = 0;
+	lateMax = 0;
+	slept = 0;
+}
+
+void FramePacer::wait() {
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	// Sleep in whole milliseconds while that leaves the margin in hand
+	if (now + spinMargin < deadline) {
+		Uint32 ms = (Uint32)((deadline - spinMargin - now) * 1000 / frequency);
+		if (ms > 0) {
+			Uint64 target = now + ms * frequency / 1000;
+			SDL_Delay(ms);
+			Uint64 woke = SDL_GetPerformanceCounter();
+			slept += woke - now;
+
+			// Keep twice the usual oversleep in hand, but never spin for long:
+			// the odd late wakeup costs less than spinning every frame
+			Uint64 over = woke > target ? woke - target : 0;
+			oversleep += ((Sint64)over - (Sint64)oversleep) / 8;
+			spinMargin = minSpin + 2 * oversleep < maxSpin ? minSpin + 2 * oversleep : maxSpin;
+			now = woke;
+		}
+	}
+	while (now < deadline) {
+		now = SDL_GetPerformanceCounter();
+	}
+
+	Uint64 late = now - deadline;
+	count++;
+	lateTotal += late;
+	if (late > lateMax) {
+		lateMax = late;
+	}
+
+	// Missed a whole frame, don't try to catch up
+	deadline += period;
+	if (deadline <= now) {
+		deadline = now + period;
+	}
+}
+
+double FramePacer::meanJitter() const {
+	return count > 0 ? lateTotal * 1e6 / frequency / count : 0.0;
+}
+
+double FramePacer::maxJitter() const {
+	return lateMax * 1e6 / frequency;
+}
+
+double FramePacer::busy() const {
+	Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+	return elapsed > 0 ? 1.0 - (double)slept / elapsed : 0.0;
+}
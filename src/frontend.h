@@ -0,0 +1,109 @@
+#pragma once
+#include <SDL.h>
+#include "chip8.h"
+
+/*
+ * Which keypad key each SDL scancode presses. Scancodes are key positions, so
+ * the default block of 1234 / QWER / ASDF / ZXCV stays in place on any
+ * keyboard layout. Only scancodes below SIZE can be mapped, which takes in
+ * every key of a usual keyboard.
+ */
+class KeyMap {
+public:
+	static const int SIZE = 256;
+
+	/* The default layout */
+	KeyMap();
+
+	/* Unmap every scancode */
+	void clear();
+
+	/* Make code press keypad key 0-F, or nothing for -1 */
+	void map(SDL_Scancode code, int key) {
+		if ((unsigned)code < SIZE) keys[code] = (signed char)(key < 0 ? -1 : key & 0xF);
+	}
+
+	/* The keypad key code presses, -1 for none */
+	int key(SDL_Scancode code) const {
+		return (unsigned)code < SIZE ? keys[code] : -1;
+	}
+private:
+	signed char keys[SIZE];
+};
+
+/* The layout handleKey uses unless given another */
+extern const KeyMap defaultKeyMap;
+
+/* Press or release the keypad key mapped to an SDL key event, other events are ignored */
+void handleKey(Chip8& chip8, const SDL_Event& e, const KeyMap& keyMap = defaultKeyMap);
+
+/*
+ * The streaming texture a Chip8 screen is shown through, and the ARGB pixels
+ * it is uploaded from. drawGraphics expands only the dirty rows into pixels,
+ * so each machine shown needs a Screen of its own. Destroy it before its
+ * renderer.
+ */
+struct Screen {
+	explicit Screen(SDL_Renderer* renderer);
+	~Screen();
+
+	SDL_Renderer* renderer;
+
+	/* NULL if it couldn't be created, see SDL_GetError */
+	SDL_Texture* texture;
+
+	/* Expanded copy of the screen, one ARGB pixel per CHIP-8 pixel */
+	Uint32 pixels[Chip8::SCREEN_HEIGHT][Chip8::SCREEN_WIDTH];
+
+	/* Set until the first drawGraphics, which expands every row */
+	bool stale;
+
+	Screen(const Screen&) = delete;
+	Screen& operator=(const Screen&) = delete;
+};
+
+/* Expand the dirty rows of the screen into the texture and present it scaled to the window */
+void drawGraphics(const Chip8& chip8, Screen& screen);
+
+/*
+ * Paces a loop to a fixed frame rate against the performance counter. Each
+ * frame has a deadline one period after the last one, so short frames don't
+ * add up to drift. wait() sleeps most of the way to the deadline with
+ * SDL_Delay, keeping back about twice what SDL_Delay usually oversleeps by
+ * (1 ms at most), and spins the rest. After a stall of more than a frame
+ * the deadlines start over from now instead of running the missed frames
+ * back to back.
+ */
+class FramePacer {
+public:
+	explicit FramePacer(int fps);
+
+	/* Wait for the current frame's deadline and move on to the next one */
+	void wait();
+
+	/* Frames waited for */
+	int frames() const { return count; }
+
+	/* How late wait() returned after the deadline, in microseconds */
+	double meanJitter() const;
+	double maxJitter() const;
+
+	/* Share of the time since construction spent outside SDL_Delay */
+	double busy() const;
+private:
+	Uint64 frequency;
+	Uint64 period;
+	Uint64 deadline;
+	Uint64 start;
+
+	/* Time left to spin rather than sleep, from the average oversleep */
+	Uint64 spinMargin;
+	Uint64 minSpin;
+	Uint64 maxSpin;
+	Uint64 oversleep;
+
+	int count;
+	Uint64 lateTotal;
+	Uint64 lateMax;
+	Uint64 slept;
+};
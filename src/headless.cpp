@@ -0,0 +1,198 @@
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include "chip8.h"
+#include "jit.h"
+#include "movie.h"
+#include "script.h"
+
+// Headless runner: loads a ROM, runs it without any window and prints the
+// final machine state. Used on the batch servers, so nothing here needs SDL.
+
+static void printUsage(const char* name) {
+	printf("Usage: %s <rom> [options]\n", name);
+	printf("  --cycles N         run N instructions\n");
+	printf("  --frames N         run N 60 Hz frames (default 600)\n");
+	printf("  --rate N           instructions per emulated second (default %d)\n", Chip8::DEFAULT_CYCLES_PER_SECOND);
+	printf("  --key AT:KEY:STATE press (1) or release (0) key 0-F before instruction AT\n");
+	printf("  --seed N           seed for the CXNN random numbers (default %llu)\n", (unsigned long long)Random::DEFAULT_SEED);
+	printf("  --load-state FILE  resume from a save state instead of starting the ROM afresh\n");
+	printf("  --save-state FILE  write a save state when the run ends\n");
+	printf("  --record FILE      write the run's key changes as a movie\n");
+	printf("  --play FILE        replay a movie: its keys, seed and rate, for its length unless\n");
+	printf("                     --cycles or --frames is given\n");
+	printf("  --jit              experimental, run through the recompiler (native code on x86-64\n");
+	printf("                     hosts), slower than the interpreter for now\n");
+	printf("Instruction numbers (AT) count from the start of the ROM, a resumed run included.\n");
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printUsage(argv[0]);
+		return 2;
+	}
+
+	std::string rom = argv[1];
+	uint64_t cycles = 0;
+	int frames = 600;
+	int rate = Chip8::DEFAULT_CYCLES_PER_SECOND;
+	uint64_t seed = Random::DEFAULT_SEED;
+	std::string loadFile;
+	std::string saveFile;
+	std::string recordFile;
+	std::string playFile;
+	bool budgetGiven = false;
+	bool useJit = false;
+	KeyScript script;
+
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--jit") {
+			useJit = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			printUsage(argv[0]);
+			return 2;
+		}
+		const char* value = argv[++i];
+		if (arg == "--cycles") {
+			cycles = strtoull(value, NULL, 10);
+			budgetGiven = true;
+		}
+		else if (arg == "--frames") {
+			frames = atoi(value);
+			budgetGiven = true;
+		}
+		else if (arg == "--rate") {
+			rate = atoi(value);
+		}
+		else if (arg == "--seed") {
+			seed = strtoull(value, NULL, 0);
+		}
+		else if (arg == "--load-state") {
+			loadFile = value;
+		}
+		else if (arg == "--save-state") {
+			saveFile = value;
+		}
+		else if (arg == "--record") {
+			recordFile = value;
+		}
+		else if (arg == "--play") {
+			playFile = value;
+		}
+		else if (arg == "--key") {
+			KeyEvent e;
+			if (parseKeyEvent(value, e) == 0) {
+				printf("Bad key event: %s\n", value);
+				return 2;
+			}
+			script.add(e);
+		}
+		else {
+			printUsage(argv[0]);
+			return 2;
+		}
+	}
+
+	// A movie brings the keys, seed and rate it was recorded with
+	Movie movie;
+	if (!loadFile.empty() && (!playFile.empty() || !recordFile.empty())) {
+		printf("Movies start with the ROM, not with a save state\n");
+		return 2;
+	}
+	if (!playFile.empty()) {
+		if (!movie.load(playFile)) {
+			printf("%s: %s\n", playFile.c_str(), movie.error.c_str());
+			return 1;
+		}
+		seed = movie.seed;
+		rate = movie.cyclesPerSecond;
+		for (const Movie::Event& m : movie.events) {
+			KeyEvent e = { m.at, m.key, m.pressed };
+			script.add(e);
+		}
+		if (!budgetGiven) {
+			cycles = movie.length;
+		}
+	}
+
+	Chip8 chip8;
+	chip8.initialize();
+	chip8.setCyclesPerSecond(rate);
+	chip8.rng.seed(seed);
+	if (!chip8.loadGame(rom)) {
+		printf("%s\n", chip8.error.c_str());
+		return 1;
+	}
+	if (!playFile.empty() && Movie::hashProgram(chip8) != movie.programHash) {
+		printf("%s: Movie was recorded with another ROM.\n", playFile.c_str());
+		return 1;
+	}
+	// A save state brings its own clock rate along with the rest of the machine
+	if (!loadFile.empty() && !chip8.loadState(loadFile)) {
+		printf("%s: %s\n", loadFile.c_str(), chip8.error.c_str());
+		return 1;
+	}
+	Movie recording;
+	recording.start(chip8, seed);
+	std::unique_ptr<Jit> jit;
+	if (useJit) {
+		jit.reset(new Jit());
+	}
+
+	// Without --cycles, the frame count sets the budget
+	uint64_t begin = chip8.cycles;
+	uint64_t end = begin + (cycles > 0 ? cycles : (uint64_t)frames * chip8.cyclesPerSecond / Chip8::TIMER_FREQUENCY);
+
+	auto start = std::chrono::steady_clock::now();
+	bool failed = false;
+	while (chip8.cycles < end) {
+		script.apply(chip8);
+		recording.record(chip8);
+
+		// Run up to the next key event or the end, whichever comes first
+		if (script.run(chip8, end, jit.get()) == Chip8::RUN_ERROR) {
+			printf("Emulation stopped: %s\n", chip8.error.c_str());
+			failed = true;
+			break;
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	recording.finish(chip8);
+
+	printf("rom     %s\n", rom.c_str());
+	printf("cycles  %llu\n", (unsigned long long)chip8.cycles);
+	printf("screen  %08x\n", hashScreen(chip8));
+	printf("V      ");
+	for (int i = 0; i < Chip8::NUM_REGISTERS; i++) {
+		printf(" %02X", chip8.V[i]);
+	}
+	printf("\n");
+	printf("I       %03X\n", chip8.I);
+	printf("pc      %03X\n", chip8.pc);
+	printf("sp      %d\n", chip8.sp);
+	printf("timers  delay %d sound %d\n", chip8.delayTimer(), chip8.soundTimer());
+	printf("waited  %llu cycles for keys\n", (unsigned long long)script.waited);
+	printf("elapsed %.3f s (%.1f M instructions/s)\n", elapsed,
+		elapsed > 0 ? (chip8.cycles - begin - script.waited) / elapsed / 1e6 : 0.0);
+	if (jit) {
+		printf("jit     %lld native, %lld interpreted instructions\n", jit->nativeInstructions, jit->interpretedInstructions);
+	}
+
+	if (!saveFile.empty() && !chip8.saveState(saveFile)) {
+		printf("%s: %s\n", saveFile.c_str(), chip8.error.c_str());
+		return 1;
+	}
+	if (!recordFile.empty() && !recording.save(recordFile)) {
+		printf("%s: %s\n", recordFile.c_str(), recording.error.c_str());
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,687 @@
+#include <string.h>
+#include <stdexcept>
+#include "jit.h"
+
+#if C8_JIT_SUPPORTED
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+static const int CODE_SIZE = 1 << 20;
+
+// Worst case size of a translated block, the code buffer is flushed when less is left
+static const int MAX_BLOCK_CODE = 512 + Jit::MAX_BLOCK_LENGTH * 192;
+
+#if C8_JIT_SUPPORTED
+
+namespace {
+
+enum Reg {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Condition codes for jcc/setcc
+enum Cond {
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7
+};
+
+// ALU opcodes for register/register forms and the /digit for register/immediate forms
+enum Alu {
+	ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39
+};
+enum AluImm {
+	IMM_ADD = 0, IMM_OR = 1, IMM_AND = 4, IMM_SUB = 5, IMM_XOR = 6, IMM_CMP = 7
+};
+
+// Registers handed out to V0-VF and I, rbx holds the Chip8 pointer and rax/rcx/rdx are scratch.
+// The volatile ones come first so small blocks have less to save.
+const Reg allocatable[] = { R8, R9, R10, R11, RSI, RDI, RBP, R12, R13, R14, R15 };
+const int NUM_ALLOCATABLE = sizeof(allocatable) / sizeof(allocatable[0]);
+
+// Whether a register must be preserved across the block, rsi and rdi are non volatile on Win64
+bool calleeSaved(Reg r) {
+	switch (r) {
+		case RBX: case RBP: case R12: case R13: case R14: case R15:
+			return true;
+#ifdef _WIN32
+		case RSI: case RDI:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+#ifdef _WIN32
+const Reg ARG0 = RCX;
+#else
+const Reg ARG0 = RDI;
+#endif
+
+// Minimal x86-64 encoder for the handful of instructions the blocks need.
+// All register operations are 32 bit, which zero extends into the upper half.
+// Memory operands are always relative to rbx, the Chip8 pointer.
+class Emitter {
+public:
+	Emitter(byte* p) : start(p), p(p) {}
+
+	int size() const { return (int)(p - start); }
+	byte* here() const { return p; }
+
+	void movRR(Reg dst, Reg src)            { rex(false, src, RAX, dst); emit(0x89); modrm(3, src, dst); }
+	void movRR64(Reg dst, Reg src)          { rex(true, src, RAX, dst); emit(0x89); modrm(3, src, dst); }
+	void movRI(Reg dst, int imm)            { rex(false, RAX, RAX, dst); emit(0xB8 + (dst & 7)); imm32(imm); }
+	void alu(Alu op, Reg dst, Reg src)      { rex(false, src, RAX, dst); emit(op); modrm(3, src, dst); }
+	void aluI(AluImm op, Reg dst, int imm)  { rex(false, RAX, RAX, dst); emit(0x81); modrm(3, op, dst); imm32(imm); }
+	void shlI(Reg dst, int n)               { rex(false, RAX, RAX, dst); emit(0xC1); modrm(3, 4, dst); emit(n); }
+	void shrI(Reg dst, int n)               { rex(false, RAX, RAX, dst); emit(0xC1); modrm(3, 5, dst); emit(n); }
+	void setcc(Cond cc, Reg dst)            { rex(false, RAX, RAX, dst, true); emit(0x0F); emit(0x90 + cc); modrm(3, 0, dst); }
+	void push(Reg r)                        { rex(false, RAX, RAX, r); emit(0x50 + (r & 7)); }
+	void pop(Reg r)                         { rex(false, RAX, RAX, r); emit(0x58 + (r & 7)); }
+	void ret()                              { emit(0xC3); }
+
+	// movzx dst, byte/word [rbx + disp]
+	void loadByte(Reg dst, int disp)        { rex(false, dst, RAX, RBX); emit(0x0F); emit(0xB6); mem(dst, disp); }
+	void loadWord(Reg dst, int disp)        { rex(false, dst, RAX, RBX); emit(0x0F); emit(0xB7); mem(dst, disp); }
+
+	// movzx dst, byte [rbx + idx + disp] and movzx dst, word [rbx + idx * 2 + disp]
+	void loadByteIdx(Reg dst, Reg idx, int disp)  { rex(false, dst, idx, RBX); emit(0x0F); emit(0xB6); memIdx(dst, idx, 0, disp); }
+	void loadWordIdx2(Reg dst, Reg idx, int disp) { rex(false, dst, idx, RBX); emit(0x0F); emit(0xB7); memIdx(dst, idx, 1, disp); }
+
+	// mov byte/word [rbx + disp], src
+	void storeByte(int disp, Reg src)       { rex(false, src, RAX, RBX, true); emit(0x88); mem(src, disp); }
+	void storeWord(int disp, Reg src)       { emit(0x66); rex(false, src, RAX, RBX); emit(0x89); mem(src, disp); }
+
+	// mov word [rbx + disp], imm and mov word [rbx + idx * 2 + disp], imm/src
+	void storeWordI(int disp, int imm)      { emit(0x66); emit(0xC7); mem(RAX, disp); imm16(imm); }
+	void storeWordIdx2(int disp, Reg idx, Reg src) {
+		emit(0x66); rex(false, src, idx, RBX); emit(0x89); memIdx(src, idx, 1, disp);
+	}
+	void storeWordIdx2I(int disp, Reg idx, int imm) {
+		emit(0x66); rex(false, RAX, idx, RBX); emit(0xC7); memIdx(RAX, idx, 1, disp); imm16(imm);
+	}
+
+	// Jumps with a 32 bit displacement, returns where to patch the target
+	byte* jcc(Cond cc)                      { emit(0x0F); emit(0x80 + cc); imm32(0); return p - 4; }
+	byte* jmp()                             { emit(0xE9); imm32(0); return p - 4; }
+	static void patch(byte* at, byte* target) {
+		int rel = (int)(target - (at + 4));
+		memcpy(at, &rel, 4);
+	}
+private:
+	byte* start;
+	byte* p;
+
+	void emit(int b) { *p++ = (byte)b; }
+	void imm16(int v) { emit(v & 0xFF); emit((v >> 8) & 0xFF); }
+	void imm32(int v) { memcpy(p, &v, 4); p += 4; }
+
+	void rex(bool w, Reg r, Reg x, Reg b, bool force = false) {
+		int bits = (w ? 8 : 0) | ((r & 8) ? 4 : 0) | ((x & 8) ? 2 : 0) | ((b & 8) ? 1 : 0);
+		// a bare REX selects sil/dil/bpl rather than dh/bh/ch for byte operands
+		if (bits != 0 || force) emit(0x40 | bits);
+	}
+	void modrm(int mod, int reg, int rm) { emit((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+	void mem(Reg reg, int disp) { modrm(2, reg, RBX); imm32(disp); }
+	void memIdx(Reg reg, Reg idx, int scale, int disp) {
+		modrm(2, reg, 4);
+		emit((scale << 6) | ((idx & 7) << 3) | RBX);
+		imm32(disp);
+	}
+};
+
+// Register set indices: 0-15 are V0-VF, 16 is I
+const int REG_I = 16;
+
+enum Kind {
+	KIND_NONE,       // left to the interpreter
+	KIND_PLAIN,      // straight line code
+	KIND_TERMINATOR  // ends the block
+};
+
+// How an opcode is translated and which registers it reads and writes
+Kind classify(u_short op, int& uses, int& writes) {
+	int x = (op & 0x0F00) >> 8;
+	int y = (op & 0x00F0) >> 4;
+	int vx = 1 << x, vy = 1 << y, vf = 1 << 0xF, i = 1 << REG_I;
+	uses = writes = 0;
+	switch (op & 0xF000) {
+		case 0x0000:
+			if ((op & 0x000F) == 0x000E) return KIND_TERMINATOR; // 00EE
+			return KIND_NONE;
+		case 0x1000:
+		case 0x2000:
+			return KIND_TERMINATOR;
+		case 0x3000:
+		case 0x4000:
+			uses = vx;
+			return KIND_TERMINATOR;
+		case 0x5000:
+		case 0x9000:
+			uses = vx | vy;
+			return KIND_TERMINATOR;
+		case 0x6000:
+		case 0x7000:
+			uses = writes = vx;
+			return KIND_PLAIN;
+		case 0x8000:
+			switch (op & 0x000F) {
+				case 0x0: case 0x1: case 0x2: case 0x3:
+					uses = vx | vy;
+					writes = vx;
+					return KIND_PLAIN;
+				case 0x4: case 0x5: case 0x6: case 0x7: case 0xE:
+					uses = vx | vy | vf;
+					writes = vx | vf;
+					return KIND_PLAIN;
+			}
+			return KIND_NONE;
+		case 0xA000:
+			uses = writes = i;
+			return KIND_PLAIN;
+		case 0xB000:
+			uses = 1;
+			return KIND_TERMINATOR;
+		case 0xE000:
+			if ((op & 0x00FF) == 0x009E || (op & 0x00FF) == 0x00A1) {
+				uses = vx;
+				return KIND_TERMINATOR;
+			}
+			return KIND_NONE;
+		case 0xF000:
+			switch (op & 0x00FF) {
+				case 0x1E:
+					uses = i | vx | vf;
+					writes = i | vf;
+					return KIND_PLAIN;
+				case 0x29:
+					uses = i | vx;
+					writes = i;
+					return KIND_PLAIN;
+				case 0x65:
+					writes = (2 << x) - 1;
+					uses = i | writes;
+					return KIND_PLAIN;
+			}
+			return KIND_NONE;
+	}
+	return KIND_NONE;
+}
+
+int countBits(int v) {
+	int n = 0;
+	for (; v; v &= v - 1) n++;
+	return n;
+}
+
+// Field offsets inside Chip8, the same for every instance
+struct Layout {
+	int V, I, pc, sp, stack, keys, memory, opcode;
+
+	Layout(const Chip8& c) {
+		const byte* base = (const byte*)&c;
+		V      = (int)((const byte*)c.V - base);
+		I      = (int)((const byte*)&c.I - base);
+		pc     = (int)((const byte*)&c.pc - base);
+		sp     = (int)((const byte*)&c.sp - base);
+		stack  = (int)((const byte*)c.stack - base);
+		keys   = (int)((const byte*)c.keys - base);
+		memory = (int)((const byte*)c.memory - base);
+		opcode = (int)((const byte*)&c.opcode - base);
+	}
+};
+
+// Translates one block. Every exit stores pc (and the opcode of the last
+// instruction executed) then jumps to a shared epilogue that writes the
+// registers back and returns the number of instructions executed.
+class BlockCompiler {
+public:
+	BlockCompiler(byte* out, const Layout& layout) : e(out), at(layout), numExits(0) {
+		for (int i = 0; i <= REG_I; i++) host[i] = RAX;
+	}
+
+	int size() const { return e.size(); }
+
+	void compile(const u_short* ops, int count, int start, int used, int dirty) {
+		this->dirty = dirty;
+
+		// Hand out host registers and find the ones we have to save
+		Reg saved[NUM_ALLOCATABLE + 1];
+		int numSaved = 0;
+		saved[numSaved++] = RBX;
+		int next = 0;
+		for (int i = 0; i <= REG_I; i++) {
+			if (used & (1 << i)) {
+				host[i] = allocatable[next++];
+				if (calleeSaved(host[i])) saved[numSaved++] = host[i];
+			}
+		}
+
+		// Prologue: save registers, keep the Chip8 pointer in rbx and load the registers used
+		for (int i = 0; i < numSaved; i++) e.push(saved[i]);
+		e.movRR64(RBX, ARG0);
+		for (int i = 0; i <= REG_I; i++) {
+			if (used & (1 << i)) {
+				if (i == REG_I) e.loadWord(host[i], at.I);
+				else            e.loadByte(host[i], at.V + i);
+			}
+		}
+
+		bool terminated = false;
+		for (int k = 0; k < count; k++) {
+			u_short prev = k > 0 ? ops[k - 1] : 0;
+			terminated = translate(ops[k], start + 2 * k, k, prev);
+		}
+		if (!terminated) {
+			// Fell off the end of the block, continue after its last instruction
+			exitTo(start + 2 * count, count, ops[count - 1]);
+		}
+
+		// Epilogue: write back what the block changed and restore registers
+		byte* epilogue = e.here();
+		for (int i = 0; i < numExits; i++) Emitter::patch(exits[i], epilogue);
+		for (int i = 0; i <= REG_I; i++) {
+			if (dirty & (1 << i)) {
+				if (i == REG_I) e.storeWord(at.I, host[i]);
+				else            e.storeByte(at.V + i, host[i]);
+			}
+		}
+		for (int i = numSaved - 1; i >= 0; i--) e.pop(saved[i]);
+		e.ret();
+	}
+private:
+	Emitter e;
+	Layout at;
+	Reg host[REG_I + 1];
+	int dirty;
+	byte* exits[Jit::MAX_BLOCK_LENGTH * 2 + 1];
+	int numExits;
+
+	// Leave the block with pc = target after executing count instructions
+	void exitTo(int target, int count, u_short lastOpcode) {
+		e.storeWordI(at.pc, target);
+		exitCommon(count, lastOpcode);
+	}
+
+	// Same with pc taken from eax
+	void exitToRax(int count, u_short lastOpcode) {
+		e.storeWord(at.pc, RAX);
+		exitCommon(count, lastOpcode);
+	}
+
+	void exitCommon(int count, u_short lastOpcode) {
+		if (count > 0) e.storeWordI(at.opcode, lastOpcode);
+		e.movRI(RAX, count);
+		exits[numExits++] = e.jmp();
+	}
+
+	// Keep a V register within a byte after arithmetic
+	void wrap(Reg r) { e.aluI(IMM_AND, r, 0xFF); }
+
+	// Skip opcodes: pc += 4 if the flags match cc, pc += 2 otherwise
+	void skip(Cond cc, int pc, int k, u_short op) {
+		byte* taken = e.jcc(cc);
+		exitTo(pc + 2, k + 1, op);
+		Emitter::patch(taken, e.here());
+		exitTo(pc + 4, k + 1, op);
+	}
+
+	// Emits instruction k at address pc, returns true if it ended the block
+	bool translate(u_short op, int pc, int k, u_short prev) {
+		Reg rx = host[(op & 0x0F00) >> 8];
+		Reg ry = host[(op & 0x00F0) >> 4];
+		Reg rf = host[0xF];
+		Reg ri = host[REG_I];
+		int nn  = op & 0x00FF;
+		int nnn = op & 0x0FFF;
+
+		switch (op & 0xF000) {
+			case 0x0000: { // 00EE: returns from subroutine
+				// an empty stack is left to the interpreter
+				e.loadWord(RAX, at.sp);
+				e.aluI(IMM_CMP, RAX, 0);
+				byte* ok = e.jcc(CC_NE);
+				exitTo(pc, k, prev);
+				Emitter::patch(ok, e.here());
+				e.aluI(IMM_SUB, RAX, 1);
+				e.storeWord(at.sp, RAX);
+				e.loadWordIdx2(RCX, RAX, at.stack);
+				e.storeWordIdx2I(at.stack, RAX, 0);
+				e.aluI(IMM_ADD, RCX, 2);
+				e.movRR(RAX, RCX);
+				exitToRax(k + 1, op);
+				return true;
+			}
+			case 0x1000: // 1NNN: jumps to address NNN
+				exitTo(nnn, k + 1, op);
+				return true;
+			case 0x2000: { // 2NNN: calls the subroutine at address NNN
+				// a full stack is left to the interpreter, which reports the overflow
+				e.loadWord(RAX, at.sp);
+				e.aluI(IMM_CMP, RAX, Chip8::NUM_LEVEL_STACK);
+				byte* ok = e.jcc(CC_B);
+				exitTo(pc, k, prev);
+				Emitter::patch(ok, e.here());
+				e.storeWordIdx2I(at.stack, RAX, pc);
+				e.aluI(IMM_ADD, RAX, 1);
+				e.storeWord(at.sp, RAX);
+				exitTo(nnn, k + 1, op);
+				return true;
+			}
+			case 0x3000: // 3XNN: skips the next instruction if VX equals NN
+				e.aluI(IMM_CMP, rx, nn);
+				skip(CC_E, pc, k, op);
+				return true;
+			case 0x4000: // 4XNN: skips the next instruction if VX doesn't equal NN
+				e.aluI(IMM_CMP, rx, nn);
+				skip(CC_NE, pc, k, op);
+				return true;
+			case 0x5000: // 5XY0: skips the next instruction if VX equals VY
+				e.alu(ALU_CMP, rx, ry);
+				skip(CC_E, pc, k, op);
+				return true;
+			case 0x9000: // 9XY0: skips the next instruction if VX doesn't equal VY
+				e.alu(ALU_CMP, rx, ry);
+				skip(CC_NE, pc, k, op);
+				return true;
+			case 0x6000: // 6XNN: sets VX to NN
+				e.movRI(rx, nn);
+				return false;
+			case 0x7000: // 7XNN: adds NN to VX
+				e.aluI(IMM_ADD, rx, nn);
+				wrap(rx);
+				return false;
+			case 0x8000:
+				translate8(op, rx, ry, rf);
+				return false;
+			case 0xA000: // ANNN: sets I to the address NNN
+				e.movRI(ri, nnn);
+				return false;
+			case 0xB000: // BNNN: jumps to the address NNN plus V0
+				e.movRR(RAX, host[0]);
+				e.aluI(IMM_ADD, RAX, nnn);
+				exitToRax(k + 1, op);
+				return true;
+			case 0xE000:
+				// EX9E/EXA1: skips the next instruction if the key stored in VX is (isn't) pressed
+				e.loadByteIdx(RAX, rx, at.keys);
+				e.aluI(IMM_CMP, RAX, (op & 0x00FF) == 0x009E ? 1 : 0);
+				skip(CC_E, pc, k, op);
+				return true;
+			case 0xF000:
+				if ((op & 0x00FF) == 0x0065) {
+					// Reading past the end of memory wraps around, left to the interpreter
+					e.aluI(IMM_CMP, ri, Chip8::MEMORY_SIZE - ((op & 0x0F00) >> 8));
+					byte* ok = e.jcc(CC_B);
+					exitTo(pc, k, prev);
+					Emitter::patch(ok, e.here());
+				}
+				translateF(op, rx, rf, ri);
+				return false;
+		}
+		return false;
+	}
+
+	void translate8(u_short op, Reg rx, Reg ry, Reg rf) {
+		// The VF update comes first, exactly like the interpreter, so X or Y being F behaves the same
+		switch (op & 0x000F) {
+			case 0x0: e.movRR(rx, ry); break;
+			case 0x1: e.alu(ALU_OR, rx, ry); break;
+			case 0x2: e.alu(ALU_AND, rx, ry); break;
+			case 0x3: e.alu(ALU_XOR, rx, ry); break;
+			case 0x4: // carry is bit 8 of the sum
+				e.movRR(RAX, rx);
+				e.alu(ALU_ADD, RAX, ry);
+				e.shrI(RAX, 8);
+				e.movRR(rf, RAX);
+				e.alu(ALU_ADD, rx, ry);
+				wrap(rx);
+				break;
+			case 0x5:
+				e.alu(ALU_XOR, RAX, RAX);
+				e.alu(ALU_CMP, rx, ry);
+				e.setcc(CC_AE, RAX);
+				e.movRR(rf, RAX);
+				e.alu(ALU_SUB, rx, ry);
+				wrap(rx);
+				break;
+			case 0x6:
+				e.movRR(RAX, rx);
+				e.aluI(IMM_AND, RAX, 0x01);
+				e.movRR(rf, RAX);
+				e.shrI(rx, 1);
+				break;
+			case 0x7:
+				e.alu(ALU_XOR, RAX, RAX);
+				e.alu(ALU_CMP, ry, rx);
+				e.setcc(CC_AE, RAX);
+				e.movRR(rf, RAX);
+				e.movRR(RAX, ry);
+				e.alu(ALU_SUB, RAX, rx);
+				wrap(RAX);
+				e.movRR(rx, RAX);
+				break;
+			case 0xE:
+				e.movRR(RAX, rx);
+				e.aluI(IMM_AND, RAX, 0x80);
+				e.movRR(rf, RAX);
+				e.shlI(rx, 1);
+				wrap(rx);
+				break;
+		}
+	}
+
+	void translateF(u_short op, Reg rx, Reg rf, Reg ri) {
+		switch (op & 0x00FF) {
+			case 0x1E: // FX1E: adds VX to I, VF is set when it goes past 0xFFF
+				e.alu(ALU_XOR, RCX, RCX);
+				e.movRR(RAX, ri);
+				e.alu(ALU_ADD, RAX, rx);
+				e.aluI(IMM_CMP, RAX, 0xFFF);
+				e.setcc(CC_A, RCX);
+				e.movRR(rf, RCX);
+				e.alu(ALU_ADD, ri, rx);
+				e.aluI(IMM_AND, ri, 0xFFFF);
+				break;
+			case 0x29: // FX29: sets I to the location of the font sprite for VX
+				e.movRR(RAX, rx);
+				e.shlI(RAX, 2);
+				e.alu(ALU_ADD, RAX, rx);
+				e.movRR(ri, RAX);
+				break;
+			case 0x65: { // FX65: fills V0 to VX with values from memory starting at address I
+				int x = (op & 0x0F00) >> 8;
+				for (int i = 0; i <= x; i++) {
+					e.loadByteIdx(host[i], ri, at.memory + i);
+				}
+				break;
+			}
+		}
+	}
+};
+
+} // namespace
+
+#endif // C8_JIT_SUPPORTED
+
+Jit::Jit() : nativeInstructions(0), interpretedInstructions(0), code(NULL), codeUsed(0) {
+#if C8_JIT_SUPPORTED
+#ifdef _WIN32
+	code = (byte*)VirtualAlloc(NULL, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void* p = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	code = p == MAP_FAILED ? NULL : (byte*)p;
+#endif
+#endif
+	reset();
+}
+
+Jit::~Jit() {
+#if C8_JIT_SUPPORTED
+	if (code != NULL) {
+#ifdef _WIN32
+		VirtualFree(code, 0, MEM_RELEASE);
+#else
+		munmap(code, CODE_SIZE);
+#endif
+	}
+#endif
+}
+
+void Jit::reset() {
+	memset(written, 0, sizeof(written));
+	flushCode();
+}
+
+void Jit::flushCode() {
+	memset(blocks, 0, sizeof(blocks));
+	memset(blockEnd, 0, sizeof(blockEnd));
+	memset(blockState, BLOCK_UNKNOWN, sizeof(blockState));
+	codeUsed = 0;
+}
+
+void Jit::markWritten(int addr, int len) {
+	for (int k = 0; k < len; k++) {
+		int b = (addr + k) & (Chip8::MEMORY_SIZE - 1);
+		written[b] = 1;
+
+		// Any block covering the byte falls back to the interpreter from now on
+		int first = b - 2 * MAX_BLOCK_LENGTH + 1;
+		for (int start = first > 0 ? first : 0; start <= b; start++) {
+			if (blockState[start] == BLOCK_NATIVE && blockEnd[start] > b) {
+				blockState[start] = BLOCK_INTERPRET;
+			}
+		}
+	}
+}
+
+void Jit::compile(const Chip8& chip8, int pc) {
+	blockState[pc] = BLOCK_INTERPRET;
+#if C8_JIT_SUPPORTED
+	if (code == NULL) return;
+
+	// Find the extent of the block and the registers it needs
+	u_short ops[MAX_BLOCK_LENGTH];
+	int count = 0, used = 0, dirty = 0;
+	for (int addr = pc; count < MAX_BLOCK_LENGTH && addr < Chip8::MEMORY_SIZE - 1; addr += 2) {
+		if (written[addr] || written[addr + 1]) break;
+
+		u_short op = chip8.memory[addr] << 8 | chip8.memory[addr + 1];
+		int uses, writes;
+		Kind kind = classify(op, uses, writes);
+		if (kind == KIND_NONE || countBits(used | uses) > NUM_ALLOCATABLE) break;
+
+		ops[count++] = op;
+		used  |= uses;
+		dirty |= writes;
+		if (kind == KIND_TERMINATOR) break;
+	}
+	if (count == 0) return;
+
+	// A jump back may close an idle loop, the interpreter passes those over
+	if ((ops[0] & 0xF000) == 0x1000 && (ops[0] & 0x0FFF) <= pc) return;
+
+	if (codeUsed + MAX_BLOCK_CODE > CODE_SIZE) {
+		flushCode();
+		blockState[pc] = BLOCK_INTERPRET;
+	}
+
+	BlockCompiler compiler(code + codeUsed, Layout(chip8));
+	compiler.compile(ops, count, pc, used, dirty);
+
+	blocks[pc]     = (BlockFn)(code + codeUsed);
+	blockEnd[pc]   = (u_short)(pc + 2 * count);
+	blockState[pc] = BLOCK_NATIVE;
+	codeUsed += compiler.size();
+#else
+	(void)chip8;
+#endif
+}
+
+int Jit::interpret(Chip8& chip8, int budget) {
+	u_short op = 0;
+	u_short addr = chip8.I;
+	if (chip8.pc < Chip8::MEMORY_SIZE - 1) {
+		op = chip8.memory[chip8.pc] << 8 | chip8.memory[chip8.pc + 1];
+	}
+
+	chip8.emulateCycle();
+	interpretedInstructions++;
+	int count = 1;
+	if (chip8.idle) {
+		count += chip8.skipIdle(budget - 1);
+	}
+
+	// Retire the blocks a memory write touched
+	if ((op & 0xF0FF) == 0xF033) {
+		markWritten(addr, 3);
+	}
+	else if ((op & 0xF0FF) == 0xF055) {
+		markWritten(addr, ((op & 0x0F00) >> 8) + 1);
+	}
+	return count;
+}
+
+int Jit::step(Chip8& chip8, int budget) {
+	int pc = chip8.pc;
+	if (pc >= Chip8::MEMORY_SIZE - 1) {
+		return interpret(chip8, budget); // reports the bad pc
+	}
+
+	if (blockState[pc] == BLOCK_UNKNOWN) {
+		compile(chip8, pc);
+	}
+	// A block may run all of its instructions, so it has to fit in the budget
+	if (blockState[pc] != BLOCK_NATIVE || (blockEnd[pc] - pc) / 2 > budget) {
+		return interpret(chip8, budget);
+	}
+
+	int count = blocks[pc](&chip8);
+	if (count == 0) {
+		// the block bailed out on its first instruction
+		return interpret(chip8, budget);
+	}
+	nativeInstructions += count;
+
+	// What emulateCycle does after every instruction, the timers are updated once per run
+	chip8.drawFlag = false;
+	chip8.cycles += count;
+	return count;
+}
+
+Chip8::RunResult Jit::runCycles(Chip8& chip8, int count) {
+	bool drew = false;
+	chip8.keyWait = false;
+	Chip8::RunResult result = Chip8::RUN_DONE;
+	try {
+		for (int done = 0; done < count; ) {
+			done += step(chip8, count - done);
+			drew |= chip8.drawFlag;
+			if (chip8.keyWait) {
+				result = Chip8::RUN_KEY_WAIT;
+				break;
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		chip8.error = e.what();
+		result = Chip8::RUN_ERROR;
+	}
+	chip8.drawFlag = drew;
+	chip8.updateTimers();
+	return result;
+}
+
+Chip8::RunResult Jit::runFrame(Chip8& chip8) {
+	// Same as Chip8::runFrame, a key wait lets the rest of the frame pass
+	uint64_t frameEnd = chip8.nextTickCycle();
+	Chip8::RunResult result = runCycles(chip8, (int)(frameEnd - chip8.cycles));
+	if (result == Chip8::RUN_KEY_WAIT) {
+		chip8.cycles = frameEnd;
+	}
+	return result == Chip8::RUN_DONE ? Chip8::RUN_FRAME : result;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "chip8.h"
+
+/* Define C8_JIT to 1 to run the SDL main loop through the recompiler instead of runFrame,
+   the console tools pick it at run time with --jit. Both are off by default: the
+   recompiler is experimental and still slower than the interpreters, see Jit */
+#ifndef C8_JIT
+#define C8_JIT 0
+#endif
+
+/* The recompiler emits x86-64 code, on any other host Jit::step just interprets */
+#if defined(_M_X64) || defined(__x86_64__)
+#define C8_JIT_SUPPORTED 1
+#else
+#define C8_JIT_SUPPORTED 0
+#endif
+
+/*
+ * Dynamic recompiler for the Chip8 core. Basic blocks are translated to native
+ * code the first time they run, ending at a control flow opcode (1NNN, 2NNN,
+ * 00EE, BNNN or a skip). V[] and I live in host registers inside a block and pc
+ * is only written on exit, so the Chip8 state after a block is the same as after
+ * interpreting it. DXYN, FX0A, the timer and memory writing opcodes and any block
+ * whose bytes were overwritten by the program are left to the interpreter.
+ *
+ * Experimental. Blocks end at every skip and jump and are not linked to each
+ * other, so in the bundled games they average one or two instructions and the
+ * call into each one costs more than interpreting it.
+ */
+class Jit {
+public:
+	Jit();
+	~Jit();
+
+	static const int MAX_BLOCK_LENGTH = 64; // in instructions
+
+	/* Run the block at chip8.pc natively if it is no longer than budget, or one
+	   instruction through emulateCycle. An idle loop is passed over up to budget
+	   as emulateCycles does. Returns the number of instructions executed */
+	int step(Chip8& chip8, int budget);
+
+	/* Chip8::runCycles and runFrame through the recompiler, ending in the same
+	   state as the interpreter */
+	Chip8::RunResult runCycles(Chip8& chip8, int count);
+	Chip8::RunResult runFrame(Chip8& chip8);
+
+	/* Drop every translated block, needed after loading a new game */
+	void reset();
+
+	/* Instruction counts since construction, to see how much of a game runs natively */
+	long long nativeInstructions;
+	long long interpretedInstructions;
+private:
+	typedef int (*BlockFn)(Chip8* chip8);
+
+	enum BlockState : byte {
+		BLOCK_UNKNOWN,   // not translated yet
+		BLOCK_NATIVE,    // translated, see blocks[]
+		BLOCK_INTERPRET  // can't be translated, or was overwritten
+	};
+
+	BlockFn blocks[Chip8::MEMORY_SIZE];
+	u_short blockEnd[Chip8::MEMORY_SIZE];
+	byte blockState[Chip8::MEMORY_SIZE];
+
+	/* Memory bytes the program has written to, never translated again */
+	byte written[Chip8::MEMORY_SIZE];
+
+	/* Executable memory the blocks are emitted into */
+	byte* code;
+	int codeUsed;
+
+	/* Translate the block starting at pc, sets blockState[pc] */
+	void compile(const Chip8& chip8, int pc);
+
+	/* Drop the translated blocks but remember what the program wrote */
+	void flushCode();
+
+	/* Mark memory[addr, addr + len), wrapped into the 4 KB address space, as
+	   written and retire the blocks covering it */
+	void markWritten(int addr, int len);
+
+	/* Run one instruction through the interpreter, and the idle loop it closes up to budget */
+	int interpret(Chip8& chip8, int budget);
+};
@@ -0,0 +1,772 @@
+#include <stdio.h>
+#include <string.h>
+#include "lockstep.h"
+
+// The register opcodes work on blocks of 16 lanes through the Lanes helpers
+// below: SSE2 where the compiler has it (every x86-64 build and 32 bit MSVC
+// since VS2012), plain byte loops elsewhere. The mask picks the lanes that
+// take part, so a block never branches on lane data. Opcodes that need per
+// lane control flow (memory, stack, screen, keys) test the mask lane by lane.
+
+static const int BLOCK = 16;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+typedef __m128i Lanes;
+
+static inline Lanes loadLanes(const byte* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void storeLanes(byte* p, Lanes v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline Lanes splat(byte v) { return _mm_set1_epi8((char)v); }
+static inline Lanes andLanes(Lanes a, Lanes b) { return _mm_and_si128(a, b); }
+static inline Lanes orLanes(Lanes a, Lanes b) { return _mm_or_si128(a, b); }
+static inline Lanes xorLanes(Lanes a, Lanes b) { return _mm_xor_si128(a, b); }
+static inline Lanes addLanes(Lanes a, Lanes b) { return _mm_add_epi8(a, b); }
+static inline Lanes subLanes(Lanes a, Lanes b) { return _mm_sub_epi8(a, b); }
+static inline Lanes equal(Lanes a, Lanes b) { return _mm_cmpeq_epi8(a, b); }
+static inline Lanes shiftRight1(Lanes a) { return _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7F)); }
+
+// m ? a : b per lane, m is 0xFF or 0
+static inline Lanes blend(Lanes m, Lanes a, Lanes b) {
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+// a >= b as unsigned bytes
+static inline Lanes atLeast(Lanes a, Lanes b) {
+	return _mm_cmpeq_epi8(_mm_max_epu8(a, b), a);
+}
+
+static inline int countLanes(Lanes m) {
+	int bits = _mm_movemask_epi8(m);
+	int count = 0;
+	for (; bits != 0; bits &= bits - 1) {
+		count++;
+	}
+	return count;
+}
+
+// Add byte sized deltas to 16 words
+static inline void addWords(u_short* p, Lanes delta) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i* words = (__m128i*)p;
+	_mm_storeu_si128(words, _mm_add_epi16(_mm_loadu_si128(words), _mm_unpacklo_epi8(delta, zero)));
+	_mm_storeu_si128(words + 1, _mm_add_epi16(_mm_loadu_si128(words + 1), _mm_unpackhi_epi8(delta, zero)));
+}
+
+// Set the masked words out of 16 to value
+static inline void selectWords(u_short* p, u_short value, Lanes m) {
+	__m128i v = _mm_set1_epi16((short)value);
+	__m128i* words = (__m128i*)p;
+	__m128i lo = _mm_unpacklo_epi8(m, m);
+	__m128i hi = _mm_unpackhi_epi8(m, m);
+	_mm_storeu_si128(words, _mm_or_si128(_mm_and_si128(lo, v), _mm_andnot_si128(lo, _mm_loadu_si128(words))));
+	_mm_storeu_si128(words + 1, _mm_or_si128(_mm_and_si128(hi, v), _mm_andnot_si128(hi, _mm_loadu_si128(words + 1))));
+}
+
+// Which of 16 words equal value
+static inline Lanes equalWords(const u_short* p, u_short value) {
+	__m128i v = _mm_set1_epi16((short)value);
+	const __m128i* words = (const __m128i*)p;
+	return _mm_packs_epi16(_mm_cmpeq_epi16(_mm_loadu_si128(words), v), _mm_cmpeq_epi16(_mm_loadu_si128(words + 1), v));
+}
+
+// Count down the masked counters out of 16, returns the lanes that reached zero
+static inline Lanes countDown(uint32_t* p, Lanes m) {
+	__m128i* counters = (__m128i*)p;
+	__m128i lo = _mm_unpacklo_epi8(m, m);
+	__m128i hi = _mm_unpackhi_epi8(m, m);
+	__m128i steps[4] = {
+		_mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo),
+		_mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi)
+	};
+	__m128i zero = _mm_setzero_si128();
+	__m128i done[4];
+	for (int i = 0; i < 4; i++) {
+		// The widened mask is -1 in the lanes that ran
+		__m128i c = _mm_add_epi32(_mm_loadu_si128(counters + i), steps[i]);
+		_mm_storeu_si128(counters + i, c);
+		done[i] = _mm_cmpeq_epi32(c, zero);
+	}
+	return _mm_packs_epi16(_mm_packs_epi32(done[0], done[1]), _mm_packs_epi32(done[2], done[3]));
+}
+
+#else
+
+struct Lanes {
+	byte b[BLOCK];
+};
+
+static inline Lanes loadLanes(const byte* p) { Lanes r; memcpy(r.b, p, BLOCK); return r; }
+static inline void storeLanes(byte* p, Lanes v) { memcpy(p, v.b, BLOCK); }
+static inline Lanes splat(byte v) { Lanes r; memset(r.b, v, BLOCK); return r; }
+
+#define C8_LANEWISE(name, expr) \
+	static inline Lanes name(Lanes a, Lanes b) { \
+		Lanes r; \
+		for (int i = 0; i < BLOCK; i++) r.b[i] = (byte)(expr); \
+		return r; \
+	}
+C8_LANEWISE(andLanes, a.b[i] & b.b[i])
+C8_LANEWISE(orLanes, a.b[i] | b.b[i])
+C8_LANEWISE(xorLanes, a.b[i] ^ b.b[i])
+C8_LANEWISE(addLanes, a.b[i] + b.b[i])
+C8_LANEWISE(subLanes, a.b[i] - b.b[i])
+C8_LANEWISE(equal, a.b[i] == b.b[i] ? 0xFF : 0)
+C8_LANEWISE(atLeast, a.b[i] >= b.b[i] ? 0xFF : 0)
+#undef C8_LANEWISE
+
+static inline Lanes shiftRight1(Lanes a) {
+	for (int i = 0; i < BLOCK; i++) a.b[i] >>= 1;
+	return a;
+}
+
+static inline Lanes blend(Lanes m, Lanes a, Lanes b) {
+	Lanes r;
+	for (int i = 0; i < BLOCK; i++) r.b[i] = (byte)((m.b[i] & a.b[i]) | (~m.b[i] & b.b[i]));
+	return r;
+}
+
+static inline int countLanes(Lanes m) {
+	int count = 0;
+	for (int i = 0; i < BLOCK; i++) count += m.b[i] & 1;
+	return count;
+}
+
+static inline void addWords(u_short* p, Lanes delta) {
+	for (int i = 0; i < BLOCK; i++) p[i] += delta.b[i];
+}
+
+static inline void selectWords(u_short* p, u_short value, Lanes m) {
+	for (int i = 0; i < BLOCK; i++) if (m.b[i]) p[i] = value;
+}
+
+static inline Lanes equalWords(const u_short* p, u_short value) {
+	Lanes r;
+	for (int i = 0; i < BLOCK; i++) r.b[i] = p[i] == value ? 0xFF : 0;
+	return r;
+}
+
+static inline Lanes countDown(uint32_t* p, Lanes m) {
+	Lanes r;
+	for (int i = 0; i < BLOCK; i++) {
+		p[i] -= m.b[i] & 1;
+		r.b[i] = p[i] == 0 ? 0xFF : 0;
+	}
+	return r;
+}
+
+#endif
+
+static_assert(Lockstep::LANE_ALIGN % BLOCK == 0, "lanes must come in whole blocks");
+
+Lockstep::Lockstep(int lanes) {
+	laneCount = lanes > 0 ? lanes : 1;
+	width = (laneCount + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN;
+
+	V.assign(Chip8::NUM_REGISTERS * width, 0);
+	I.assign(width, 0);
+	pc.assign(width, 0);
+	sp.assign(width, 0);
+	stack.assign(Chip8::NUM_LEVEL_STACK * width, 0);
+	delayTimer.assign(width, 0);
+	soundTimer.assign(width, 0);
+	delayTimerStart.assign(width, 0);
+	soundTimerStart.assign(width, 0);
+	cycles.assign(width, 0);
+	keys.assign(width, 0);
+	lastOpcode.assign(width, 0);
+	dirty.assign(width, 0);
+	drew.assign(width, 0);
+	beep.assign(width, 0);
+	beepPending.assign(width, 0);
+	rng.assign(width, Random());
+	memory.assign((size_t)width * MEMORY_STRIDE, 0);
+	gfx.assign((size_t)width * Chip8::SCREEN_HEIGHT, 0);
+	status.assign(width, LANE_HALTED);
+	errors.assign(width, std::string());
+	remaining.assign(width, 0);
+	ready.assign(width, 0);
+	mask.assign(width, 0);
+	runCount = 0;
+	cyclesPerSecond = Chip8::DEFAULT_CYCLES_PER_SECOND;
+	writtenLow = Chip8::MEMORY_SIZE;
+	writtenHigh = -1;
+	lead = 0;
+	converged = false;
+	steps = 0;
+	laneInstructions = 0;
+}
+
+void Lockstep::load(const Chip8& source) {
+	// Padding lanes stay halted so they never take part in a step
+	for (int l = 0; l < width; l++) {
+		for (int r = 0; r < Chip8::NUM_REGISTERS; r++) {
+			reg(r)[l] = source.V[r];
+		}
+		for (int i = 0; i < Chip8::NUM_LEVEL_STACK; i++) {
+			stack[i * width + l] = source.stack[i];
+		}
+		I[l] = source.I;
+		pc[l] = source.pc;
+		sp[l] = (byte)source.sp;
+		delayTimer[l] = source.delay_timer;
+		soundTimer[l] = source.sound_timer;
+		delayTimerStart[l] = source.delay_timer_start;
+		soundTimerStart[l] = source.sound_timer_start;
+		cycles[l] = source.cycles;
+		rng[l] = source.rng;
+		lastOpcode[l] = source.opcode;
+		dirty[l] = source.dirty;
+		drew[l] = source.drawFlag;
+		beep[l] = source.beep;
+		beepPending[l] = source.beepPending;
+
+		keys[l] = 0;
+		for (int k = 0; k < 16; k++) {
+			if (source.keys[k]) {
+				keys[l] |= 1 << k;
+			}
+		}
+
+		memcpy(laneMemory(l), source.memory, Chip8::MEMORY_SIZE);
+		memcpy(laneGfx(l), source.gfx, sizeof(source.gfx));
+		status[l] = l >= laneCount ? LANE_HALTED : source.keyWait ? LANE_WAITING : LANE_RUNNING;
+		errors[l].clear();
+	}
+	cyclesPerSecond = source.cyclesPerSecond;
+	writtenLow = Chip8::MEMORY_SIZE;
+	writtenHigh = -1;
+	lead = 0;
+	converged = false;
+	steps = 0;
+	laneInstructions = 0;
+}
+
+void Lockstep::store(int lane, Chip8& dest) const {
+	for (int r = 0; r < Chip8::NUM_REGISTERS; r++) {
+		dest.V[r] = V[r * width + lane];
+	}
+	for (int i = 0; i < Chip8::NUM_LEVEL_STACK; i++) {
+		dest.stack[i] = stack[i * width + lane];
+	}
+	dest.I = I[lane];
+	dest.pc = pc[lane];
+	dest.sp = sp[lane];
+	dest.delay_timer = delayTimer[lane];
+	dest.sound_timer = soundTimer[lane];
+	dest.delay_timer_start = delayTimerStart[lane];
+	dest.sound_timer_start = soundTimerStart[lane];
+	dest.cycles = cycles[lane];
+	dest.cyclesPerSecond = cyclesPerSecond;
+	dest.rng = rng[lane];
+	dest.opcode = lastOpcode[lane];
+	dest.dirty = dirty[lane];
+	dest.drawFlag = drew[lane] != 0;
+	dest.beep = beep[lane] != 0;
+	dest.beepPending = beepPending[lane] != 0;
+	dest.keyWait = status[lane] == LANE_WAITING;
+	for (int k = 0; k < 16; k++) {
+		dest.keys[k] = (keys[lane] >> k) & 1;
+	}
+	memcpy(dest.memory, &memory[(size_t)lane * MEMORY_STRIDE], Chip8::MEMORY_SIZE);
+	memcpy(dest.gfx, &gfx[(size_t)lane * Chip8::SCREEN_HEIGHT], sizeof(dest.gfx));
+	dest.flushDecodeCache();
+}
+
+void Lockstep::setKey(int lane, int key, bool pressed) {
+	if (pressed) {
+		keys[lane] |= 1 << (key & 0xF);
+	}
+	else {
+		keys[lane] &= ~(1 << (key & 0xF));
+	}
+}
+
+void Lockstep::run(int count) {
+	runCount = count > 0 ? (uint32_t)count : 0;
+
+	// Like Chip8::runCycles, a lane waiting for a key tries FX0A again
+	for (int l = 0; l < width; l++) {
+		if (status[l] == LANE_WAITING) {
+			status[l] = LANE_RUNNING;
+		}
+		remaining[l] = runCount;
+		drew[l] = 0;
+		ready[l] = status[l] == LANE_RUNNING && runCount > 0 ? 0xFF : 0;
+	}
+	converged = false;
+
+	u_short opcode;
+	while (selectLanes(opcode)) {
+		for (int l = 0; l < width; l += BLOCK) {
+			selectWords(&lastOpcode[l], opcode, loadLanes(&mask[l]));
+		}
+		execute(opcode);
+		for (int l = 0; l < width; l += BLOCK) {
+			Lanes finished = countDown(&remaining[l], loadLanes(&mask[l]));
+			storeLanes(&ready[l], blend(finished, splat(0), loadLanes(&ready[l])));
+		}
+	}
+
+	for (int l = 0; l < width; l++) {
+		cycles[l] += runCount - remaining[l];
+		remaining[l] = 0;
+	}
+	runCount = 0;
+
+	// Chip8::updateTimers after the batch
+	for (int l = 0; l < width; l++) {
+		if (beepPending[l] && status[l] != LANE_HALTED && soundTimerValue(l) == 0) {
+			beep[l] = 1;
+			beepPending[l] = 0;
+		}
+	}
+}
+
+uint64_t Lockstep::timerTicks(int lane) const {
+	// cycles is only brought up to date at the end of a run
+	uint64_t now = cycles[lane] + runCount - remaining[lane];
+	return now * Chip8::TIMER_FREQUENCY / cyclesPerSecond;
+}
+
+byte Lockstep::soundTimerValue(int lane) const {
+	uint64_t elapsed = timerTicks(lane) - soundTimerStart[lane];
+	return elapsed >= soundTimer[lane] ? 0 : (byte)(soundTimer[lane] - elapsed);
+}
+
+void Lockstep::skipIdle(int lane, int at, int target) {
+	// The jump itself was the lane's last instruction so far, it has not been counted yet
+	uint64_t now = cycles[lane] + runCount - remaining[lane] + 1;
+	uint32_t left = remaining[lane] - 1;
+	const byte* code = laneMemory(lane);
+
+	int length = 1;
+	uint64_t wake = UINT64_MAX;
+	if (target != at) {
+		// FX07, then 3XNN or 4XNN on the same VX, then the jump back to the FX07
+		if (target + 4 != at || (code[target] & 0xF0) != 0xF0 || code[target + 1] != 0x07 ||
+				((code[target + 2] & 0xF0) != 0x30 && (code[target + 2] & 0xF0) != 0x40) ||
+				(code[target + 2] & 0x0F) != (code[target] & 0x0F)) {
+			return;
+		}
+		length = 3;
+		uint64_t ticks = now * Chip8::TIMER_FREQUENCY / cyclesPerSecond;
+		uint64_t elapsed = ticks - delayTimerStart[lane];
+		byte value = reg(code[target] & 0x0F)[lane];
+		if ((elapsed >= delayTimer[lane] ? 0 : delayTimer[lane] - elapsed) != value) {
+			return;
+		}
+		if (value != 0) {
+			wake = ((ticks + 1) * cyclesPerSecond + Chip8::TIMER_FREQUENCY - 1) / Chip8::TIMER_FREQUENCY;
+		}
+	}
+
+	uint64_t iterations = left / length;
+	if (wake != UINT64_MAX && (wake - now + length - 1) / length < iterations) {
+		iterations = (wake - now + length - 1) / length;
+	}
+	remaining[lane] -= (uint32_t)(iterations * length);
+}
+
+void Lockstep::noteWrite(int addr, int len) {
+	addr &= Chip8::MEMORY_SIZE - 1;
+	if (addr + len > Chip8::MEMORY_SIZE) {
+		// Wrapped around the end, both ends of memory were written
+		writtenLow = 0;
+		writtenHigh = Chip8::MEMORY_SIZE - 1;
+		return;
+	}
+	if (addr < writtenLow) writtenLow = addr;
+	if (addr + len - 1 > writtenHigh) writtenHigh = addr + len - 1;
+}
+
+void Lockstep::halt(int lane, const char* message) {
+	status[lane] = LANE_HALTED;
+	errors[lane] = message;
+	ready[lane] = 0;
+	mask[lane] = 0;
+}
+
+bool Lockstep::selectLanes(u_short& opcode) {
+	for (;;) {
+		// While every ready lane took the last step they are still together.
+		// Otherwise go to the lowest pc: lanes that branched ahead wait there
+		// while the others catch up, which is usually where the paths meet
+		if (!converged || !ready[lead]) {
+			lead = -1;
+			for (int l = 0; l < laneCount; l++) {
+				if (ready[l] && (lead < 0 || pc[l] < pc[lead])) {
+					lead = l;
+				}
+			}
+			if (lead < 0) {
+				return false;
+			}
+		}
+
+		u_short at = pc[lead];
+		if (at >= Chip8::MEMORY_SIZE - 1) {
+			halt(lead, "Program counter is out of memory boundary!");
+			converged = false;
+			continue;
+		}
+		const byte* code = laneMemory(lead) + at;
+		opcode = (u_short)(code[0] << 8 | code[1]);
+
+		int runnable = 0;
+		int selected = 0;
+		for (int l = 0; l < width; l += BLOCK) {
+			Lanes r = loadLanes(&ready[l]);
+			Lanes m = andLanes(r, equalWords(&pc[l], at));
+			storeLanes(&mask[l], m);
+			runnable += countLanes(r);
+			selected += countLanes(m);
+		}
+
+		// A lane that rewrote the opcode runs it in a step of its own
+		if (at + 1 >= writtenLow && at <= writtenHigh) {
+			for (int l = 0; l < width; l++) {
+				const byte* other = laneMemory(l) + at;
+				if (mask[l] && (other[0] != code[0] || other[1] != code[1])) {
+					mask[l] = 0;
+					selected--;
+				}
+			}
+		}
+
+		converged = selected == runnable;
+		steps++;
+		laneInstructions += selected;
+		return true;
+	}
+}
+
+void Lockstep::execute(u_short opcode) {
+	const int x = (opcode & 0x0F00) >> 8;
+	const int y = (opcode & 0x00F0) >> 4;
+	const byte n = opcode & 0x000F;
+	const byte nn = opcode & 0x00FF;
+	const u_short nnn = opcode & 0x0FFF;
+	const byte* m = mask.data();
+	byte* vx = reg(x);
+	byte* vy = reg(y);
+	byte* vf = reg(0xF);
+	u_short* p = pc.data();
+	const int w = width;
+	const Lanes one = splat(1);
+	const Lanes two = splat(2);
+	const Lanes four = splat(4);
+
+	switch (opcode & 0xF000) {
+		case 0x0000:
+			// Chip8 only looks at the low nibble of the 0 group
+			if (n == 0x0) { // 00E0: clears the screen
+				for (int l = 0; l < w; l++) {
+					if (!m[l]) continue;
+					uint64_t* screen = laneGfx(l);
+					for (int r = 0; r < Chip8::SCREEN_HEIGHT; r++) {
+						if (screen[r] != 0) {
+							dirty[l] |= 1u << r;
+						}
+						screen[r] = 0;
+					}
+					drew[l] = 1;
+					p[l] += 2;
+				}
+			}
+			else if (n == 0xE) { // 00EE: returns from subroutine
+				for (int l = 0; l < w; l++) {
+					if (!m[l]) continue;
+					if (sp[l] == 0) {
+						halt(l, "Stack underflow!");
+						continue;
+					}
+					sp[l]--;
+					p[l] = stack[sp[l] * w + l] + 2;
+					stack[sp[l] * w + l] = 0;
+				}
+			}
+			else {
+				// Unknown opcode, like Chip8 it is reported and pc stays put
+				fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
+			}
+			break;
+		case 0x1000: { // 1NNN: jumps to address NNN
+			// Every lane in the step is at the lead's pc
+			const int at = p[lead];
+			for (int l = 0; l < w; l += BLOCK) {
+				selectWords(p + l, nnn, loadLanes(m + l));
+			}
+			if (nnn == at || nnn + 4 == at) {
+				for (int l = 0; l < w; l++) {
+					if (m[l]) skipIdle(l, at, nnn);
+				}
+			}
+			break;
+		}
+		case 0x2000: // 2NNN: calls the subroutine at address NNN
+			for (int l = 0; l < w; l++) {
+				if (!m[l]) continue;
+				if (sp[l] >= Chip8::NUM_LEVEL_STACK) {
+					halt(l, "Stack overflow!");
+					continue;
+				}
+				stack[sp[l] * w + l] = p[l];
+				sp[l]++;
+				p[l] = nnn;
+			}
+			break;
+		case 0x3000: // 3XNN: skips the next instruction if VX equals NN
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes skip = equal(loadLanes(vx + l), splat(nn));
+				addWords(p + l, andLanes(loadLanes(m + l), blend(skip, four, two)));
+			}
+			break;
+		case 0x4000: // 4XNN: skips the next instruction if VX doesn't equal NN
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes stay = equal(loadLanes(vx + l), splat(nn));
+				addWords(p + l, andLanes(loadLanes(m + l), blend(stay, two, four)));
+			}
+			break;
+		case 0x5000: // 5XY0: skips the next instruction if VX equals VY
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes skip = equal(loadLanes(vx + l), loadLanes(vy + l));
+				addWords(p + l, andLanes(loadLanes(m + l), blend(skip, four, two)));
+			}
+			break;
+		case 0x6000: // 6XNN: sets VX to NN
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes mk = loadLanes(m + l);
+				storeLanes(vx + l, blend(mk, splat(nn), loadLanes(vx + l)));
+				addWords(p + l, andLanes(mk, two));
+			}
+			break;
+		case 0x7000: // 7XNN: adds NN to VX
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes mk = loadLanes(m + l);
+				storeLanes(vx + l, addLanes(loadLanes(vx + l), andLanes(mk, splat(nn))));
+				addWords(p + l, andLanes(mk, two));
+			}
+			break;
+		case 0x8000: {
+			// VF is stored before VX and VY are loaded again, as Chip8 orders
+			// it, which matters when X or Y is F
+			if (n > 0x7 && n != 0xE) {
+				// Unknown opcode, pc stays put
+				fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
+				break;
+			}
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes mk = loadLanes(m + l);
+				Lanes a = loadLanes(vx + l);
+				Lanes b = loadLanes(vy + l);
+				switch (n) {
+					case 0x0: // 8XY0: sets VX to the value of VY
+						storeLanes(vx + l, blend(mk, b, a));
+						break;
+					case 0x1: // 8XY1: sets VX to VX or VY
+						storeLanes(vx + l, blend(mk, orLanes(a, b), a));
+						break;
+					case 0x2: // 8XY2: sets VX to VX and VY
+						storeLanes(vx + l, blend(mk, andLanes(a, b), a));
+						break;
+					case 0x3: // 8XY3: sets VX to VX xor VY
+						storeLanes(vx + l, blend(mk, xorLanes(a, b), a));
+						break;
+					case 0x4: // 8XY4: adds VY to VX, VF is the carry
+						// There is a carry when the sum wrapped below VX
+						storeLanes(vf + l, blend(mk, blend(atLeast(addLanes(a, b), a), splat(0), one), loadLanes(vf + l)));
+						a = loadLanes(vx + l);
+						b = loadLanes(vy + l);
+						storeLanes(vx + l, blend(mk, addLanes(a, b), a));
+						break;
+					case 0x5: // 8XY5: subtracts VY from VX, VF is 1 when there's no borrow
+						storeLanes(vf + l, blend(mk, andLanes(atLeast(a, b), one), loadLanes(vf + l)));
+						a = loadLanes(vx + l);
+						b = loadLanes(vy + l);
+						storeLanes(vx + l, blend(mk, subLanes(a, b), a));
+						break;
+					case 0x6: // 8XY6: shifts VX right by one, VF is the bit shifted out
+						storeLanes(vf + l, blend(mk, andLanes(a, one), loadLanes(vf + l)));
+						a = loadLanes(vx + l);
+						storeLanes(vx + l, blend(mk, shiftRight1(a), a));
+						break;
+					case 0x7: // 8XY7: sets VX to VY minus VX, VF is 1 when there's no borrow
+						storeLanes(vf + l, blend(mk, andLanes(atLeast(b, a), one), loadLanes(vf + l)));
+						a = loadLanes(vx + l);
+						b = loadLanes(vy + l);
+						storeLanes(vx + l, blend(mk, subLanes(b, a), a));
+						break;
+					case 0xE: // 8XYE: shifts VX left by one, VF is the bit shifted out
+						storeLanes(vf + l, blend(mk, andLanes(a, splat(0x80)), loadLanes(vf + l)));
+						a = loadLanes(vx + l);
+						storeLanes(vx + l, blend(mk, addLanes(a, a), a));
+						break;
+				}
+				addWords(p + l, andLanes(mk, two));
+			}
+			break;
+		}
+		case 0x9000: // 9XY0: skips the next instruction if VX doesn't equal VY
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes stay = equal(loadLanes(vx + l), loadLanes(vy + l));
+				addWords(p + l, andLanes(loadLanes(m + l), blend(stay, two, four)));
+			}
+			break;
+		case 0xA000: // ANNN: sets I to the address NNN
+			for (int l = 0; l < w; l += BLOCK) {
+				Lanes mk = loadLanes(m + l);
+				selectWords(&I[l], nnn, mk);
+				addWords(p + l, andLanes(mk, two));
+			}
+			break;
+		case 0xB000: // BNNN: jumps to the address NNN plus V0
+			for (int l = 0; l < w; l++) {
+				if (m[l]) p[l] = (u_short)(nnn + reg(0)[l]);
+			}
+			break;
+		case 0xC000: // CXNN: sets VX to a random number and NN
+			for (int l = 0; l < w; l++) {
+				if (!m[l]) continue;
+				vx[l] = nn & rng[l].next();
+				p[l] += 2;
+			}
+			break;
+		case 0xD000: // DXYN: draws an N rows high sprite from memory[I] at (VX, VY)
+			for (int l = 0; l < w; l++) {
+				if (!m[l]) continue;
+				// As in Chip8::drawSprite VF is cleared first and set on the first
+				// collision, and VX and VY are read again for every row, so with X
+				// or Y being F the rows after a collision move
+				vf[l] = 0;
+				uint64_t* screen = laneGfx(l);
+				for (int i = 0; i < n; i++) {
+					uint64_t row = (uint64_t)laneByte(l, I[l] + i) << (Chip8::SCREEN_WIDTH - 8);
+					int shift = vx[l] % Chip8::SCREEN_WIDTH;
+					if (shift != 0) {
+						row = (row >> shift) | (row << (Chip8::SCREEN_WIDTH - shift));
+					}
+					int r = (i + vy[l]) % Chip8::SCREEN_HEIGHT;
+					if ((screen[r] & row) != 0) {
+						vf[l] = 1;
+					}
+					screen[r] ^= row;
+					if (row != 0) {
+						dirty[l] |= 1u << r;
+					}
+				}
+				drew[l] = 1;
+				p[l] += 2;
+			}
+			break;
+		case 0xE000:
+			if (nn == 0x9E || nn == 0xA1) {
+				// EX9E: skips the next instruction if the key stored in VX is pressed
+				// EXA1: skips the next instruction if the key stored in VX isn't pressed
+				for (int l = 0; l < w; l++) {
+					if (!m[l]) continue;
+					bool pressed = vx[l] < 16 && ((keys[l] >> vx[l]) & 1) != 0;
+					p[l] += pressed == (nn == 0x9E) ? 4 : 2;
+				}
+			}
+			else {
+				fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
+			}
+			break;
+		case 0xF000:
+			switch (nn) {
+				case 0x07: // FX07: sets VX to the value of the delay timer
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						uint64_t elapsed = timerTicks(l) - delayTimerStart[l];
+						vx[l] = elapsed >= delayTimer[l] ? 0 : (byte)(delayTimer[l] - elapsed);
+						p[l] += 2;
+					}
+					break;
+				case 0x0A: // FX0A: a key press is awaited, and then stored in VX
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						if (keys[l] == 0) {
+							// The instruction still counts, the lane sits out the rest of the run
+							status[l] = LANE_WAITING;
+							ready[l] = 0;
+							continue;
+						}
+						int key = 0;
+						while (((keys[l] >> key) & 1) == 0) key++;
+						vx[l] = (byte)key;
+						p[l] += 2;
+					}
+					break;
+				case 0x15: // FX15: sets the delay timer to VX
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						delayTimer[l] = vx[l];
+						delayTimerStart[l] = timerTicks(l);
+						p[l] += 2;
+					}
+					break;
+				case 0x18: // FX18: sets the sound timer to VX
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						// A sound that ran out earlier in the run still beeps
+						if (beepPending[l] && soundTimerValue(l) == 0) {
+							beep[l] = 1;
+						}
+						soundTimer[l] = vx[l];
+						soundTimerStart[l] = timerTicks(l);
+						beepPending[l] = soundTimer[l] > 0;
+						p[l] += 2;
+					}
+					break;
+				case 0x1E: // FX1E: adds VX to I, VF is set when it passes 0xFFF
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						vf[l] = I[l] + vx[l] > 0xFFF ? 1 : 0;
+						I[l] += vx[l];
+						p[l] += 2;
+					}
+					break;
+				case 0x29: // FX29: sets I to the location of the sprite for the character in VX
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						I[l] = (u_short)(5 * vx[l]);
+						p[l] += 2;
+					}
+					break;
+				case 0x33: // FX33: stores the BCD representation of VX at I, I plus 1 and I plus 2
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						laneByte(l, I[l])     = vx[l] / 100;
+						laneByte(l, I[l] + 1) = (vx[l] / 10) % 10;
+						laneByte(l, I[l] + 2) = vx[l] % 10;
+						noteWrite(I[l], 3);
+						p[l] += 2;
+					}
+					break;
+				case 0x55: // FX55: stores V0 to VX in memory starting at address I
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						for (int i = 0; i <= x; i++) {
+							laneByte(l, I[l] + i) = reg(i)[l];
+						}
+						noteWrite(I[l], x + 1);
+						p[l] += 2;
+					}
+					break;
+				case 0x65: // FX65: fills V0 to VX with values from memory starting at address I
+					for (int l = 0; l < w; l++) {
+						if (!m[l]) continue;
+						for (int i = 0; i <= x; i++) {
+							reg(i)[l] = laneByte(l, I[l] + i);
+						}
+						p[l] += 2;
+					}
+					break;
+				default:
+					fprintf(stderr, "Unknown opcode: 0x%X\n", opcode);
+					break;
+			}
+			break;
+	}
+}
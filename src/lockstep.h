@@ -0,0 +1,161 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+/*
+ * Runs many instances of the same program in lockstep. The registers, stack
+ * and timers of all lanes are stored structure-of-arrays, one array per
+ * register with one entry per lane, and every step executes one opcode for
+ * all lanes sitting at the same pc. Register opcodes (6XNN, 7XNN, 8XYN, the
+ * skips, ANNN, FX1E...) are branch-free loops over the lanes under a byte
+ * mask, 16 lanes at a time with SSE2 where the compiler has it. The rest
+ * (DXYN, the stack, timers, keys and memory) run lane by lane under the same
+ * mask.
+ *
+ * Like Chip8, a loop that only waits (a jump to itself or a delay timer
+ * poll) is passed over up to the next timer tick instead of run.
+ *
+ * Lanes whose pc differs take separate steps. After a split the lanes with
+ * the lowest pc go first, so the ones that jumped ahead wait for the rest and
+ * the groups merge again where the paths meet. Every lane still gets its
+ * full budget in each run.
+ *
+ * Every lane has its own random number generator and ends up in the same
+ * state a Chip8 given the same keys and seed would reach. Lanes start with
+ * the generator of the loaded Chip8, so they stay together through CXNN
+ * unless seedLane gives them different sequences.
+ */
+class Lockstep {
+public:
+	/* Lane counts are rounded up to this, so the lane loops need no tail */
+	static const int LANE_ALIGN = 32;
+
+	explicit Lockstep(int lanes);
+
+	int lanes() const { return laneCount; }
+
+	/* Start every lane from the state of source, usually freshly initialized and loaded */
+	void load(const Chip8& source);
+
+	/* Copy a lane's machine state into dest, to inspect or keep running it there */
+	void store(int lane, Chip8& dest) const;
+
+	/* Restart a lane's random number sequence */
+	void seedLane(int lane, uint64_t seed) { rng[lane].seed(seed); }
+
+	/* Press or release one of a lane's 16 keys */
+	void setKey(int lane, int key, bool pressed);
+
+	/* Run every lane for up to count instructions. A lane stops early when
+	   FX0A finds no key pressed, and retries it on the next run */
+	void run(int count);
+
+	/* Instructions a lane has executed since load */
+	uint64_t laneCycles(int lane) const { return cycles[lane]; }
+
+	/* Whether a lane is waiting in FX0A for a key press */
+	bool waiting(int lane) const { return status[lane] == LANE_WAITING; }
+
+	/* What stopped a lane, empty while it runs */
+	const std::string& error(int lane) const { return errors[lane]; }
+
+	/* Steps taken and lane instructions executed since load, their ratio is
+	   how many lanes an opcode ran for on average */
+	uint64_t steps;
+	uint64_t laneInstructions;
+private:
+	enum LaneStatus : byte {
+		LANE_RUNNING,
+		LANE_WAITING, // FX0A found no key pressed
+		LANE_HALTED   // see errors
+	};
+
+	/* Distance between the lanes' memory blocks. Addresses are wrapped into
+	   the block (see laneByte), the extra bytes only keep the same address of
+	   neighbouring lanes out of the same cache set */
+	static const int MEMORY_STRIDE = Chip8::MEMORY_SIZE + 32;
+	static_assert((Chip8::MEMORY_SIZE & (Chip8::MEMORY_SIZE - 1)) == 0, "addresses are wrapped with a mask");
+
+	int laneCount; // the lanes asked for
+	int width;     // laneCount rounded up to LANE_ALIGN, the stride of the arrays below
+
+	/* Register files, structure-of-arrays: register r of lane l is at [r * width + l] */
+	std::vector<byte> V;
+	std::vector<u_short> I;
+	std::vector<u_short> pc;
+	std::vector<byte> sp;
+	std::vector<u_short> stack;
+
+	/* Lazy timers as in Chip8 */
+	std::vector<byte> delayTimer;
+	std::vector<byte> soundTimer;
+	std::vector<uint64_t> delayTimerStart;
+	std::vector<uint64_t> soundTimerStart;
+	std::vector<uint64_t> cycles;
+	int cyclesPerSecond;
+
+	/* Pressed keys, bit k is key k */
+	std::vector<u_short> keys;
+
+	/* The rest of a Chip8's machine state, kept so store hands out the same
+	   machine: the last opcode, rows changed since load (as Chip8::dirty),
+	   whether the current run drew, and the beep flags */
+	std::vector<u_short> lastOpcode;
+	std::vector<uint32_t> dirty;
+	std::vector<byte> drew;
+	std::vector<byte> beep;
+	std::vector<byte> beepPending;
+
+	/* Random numbers for CXNN, one generator per lane */
+	std::vector<Random> rng;
+
+	/* Memory and screen are only touched lane by lane, so each lane keeps its own block */
+	std::vector<byte> memory;
+	std::vector<uint64_t> gfx;
+
+	std::vector<byte> status;
+	std::vector<std::string> errors;
+
+	/* Instructions each lane has left in the current run, and the lanes that
+	   can still take a step in it, 0xFF or 0. cycles catches up at the end */
+	std::vector<uint32_t> remaining;
+	std::vector<byte> ready;
+	uint32_t runCount;
+
+	/* Lanes taking part in the current step, 0xFF or 0 */
+	std::vector<byte> mask;
+
+	/* Addresses any lane has written since load. Outside of them every lane
+	   still has the loaded program, so lanes at the same pc run the same opcode */
+	int writtenLow, writtenHigh;
+
+	/* The lane that ran last and whether every runnable lane took part */
+	int lead;
+	bool converged;
+
+	byte* reg(int r) { return &V[r * width]; }
+	byte* laneMemory(int lane) { return &memory[(size_t)lane * MEMORY_STRIDE]; }
+
+	/* A lane's memory at addr, wrapped into the 4 KB address space since I and
+	   the bytes after it can point anywhere up to 0xFFFF + 15 */
+	byte& laneByte(int lane, int addr) { return laneMemory(lane)[addr & (Chip8::MEMORY_SIZE - 1)]; }
+	uint64_t* laneGfx(int lane) { return &gfx[(size_t)lane * Chip8::SCREEN_HEIGHT]; }
+	uint64_t timerTicks(int lane) const;
+	byte soundTimerValue(int lane) const;
+	void noteWrite(int addr, int len);
+	void halt(int lane, const char* message);
+
+	/* Pick the lane to run next and mark the lanes that share its pc and
+	   opcode, returns false once no lane can run */
+	bool selectLanes(u_short& opcode);
+
+	/* Execute one opcode for every lane in mask */
+	void execute(u_short opcode);
+
+	/* After a lane at pc at jumped back to target: when that closes a loop
+	   that only waits, as in Chip8::idleLoop, pass over the iterations up to
+	   where the loop could first see something change, as Chip8::skipIdle */
+	void skipIdle(int lane, int at, int target);
+};
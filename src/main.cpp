@@ -1,56 +1,58 @@
 #include "stdafx.h"
+#include <time.h>
 #include <string>
 #include "chip8.h"
+#include "jit.h"
+#include "frontend.h"
+#include "rewind.h"
+#include "movie.h"
 #include <SDL.h>
-#include <iostream>
-#include <fstream>
 
-void drawGraphics(const Chip8& chip8, SDL_Window* window, SDL_Renderer* renderer) {
-	// Set render color to black and clear screen with this color
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-	SDL_RenderClear(renderer);
-
-	// Set render color to white (rect will be rendered in this color)
-	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+//Initial window dimension constants, the window can be resized
+const int SCREEN_WIDTH  = 640;
+const int SCREEN_HEIGHT = 320;
 
-	for (int i = 0; i < chip8.SCREEN_HEIGHT; i++) {
-		for (int j = 0; j < chip8.SCREEN_WIDTH; j++) {
-			if (chip8.gfx[i][j] == 1) {
-				// Creat a rect at pos (j * 10, i * 10) that's 10 pixels wide and 10 pixels high.
-				SDL_Rect r = { j * 10, i * 10, 10, 10 };
+const int SCREEN_FPS = 60;
 
-				// Render rect
-				if (SDL_RenderFillRect(renderer, &r) == -1) {
-					printf("There's an error with SDL_RenderFillRect");
-				}
-			}
-		}
-	}
+// Instructions run per 60 Hz frame unless given as the first argument
+const int DEFAULT_CYCLES_PER_FRAME = 10;
 
-	SDL_RenderPresent(renderer);
-}
+// Held down to step back through the last frames, one per frame
+const SDL_Scancode REWIND_KEY = SDL_SCANCODE_BACKSPACE;
 
-//Screen dimension constants
-const int SCREEN_WIDTH  = 640;
-const int SCREEN_HEIGHT = 320;
+const char* const ROM_PATH = "games/pong2.c8";
 
-const int SCREEN_FPS = 60;
-const int SCREEN_TICKS_PER_FRAME = 1000 / SCREEN_FPS;
+// Every session's input is written here on exit, replay it with c8headless --play
+const char* const MOVIE_PATH = "last.c8m";
 
 int _tmain(int argc, _TCHAR* argv[]) {
 	Chip8 chip8;
+	int cyclesPerFrame = argc > 1 ? _ttoi(argv[1]) : DEFAULT_CYCLES_PER_FRAME;
+	if (cyclesPerFrame <= 0) cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+#if C8_JIT
+	Jit jit;
+#endif
 
 	// Initialize the Chip8 system and load the game into the memory
 	chip8.initialize();
-	chip8.loadGame();
+	chip8.setCyclesPerSecond(cyclesPerFrame * SCREEN_FPS);
+	// A new game every time, the core alone always plays the same one
+	uint64_t seed = (uint64_t)time(NULL);
+	chip8.rng.seed(seed);
+	if (!chip8.loadGame(ROM_PATH)) {
+		printf("%s\n", chip8.error.c_str());
+		return 1;
+	}
+	Movie movie;
+	movie.start(chip8, seed);
 
 	// Initialize SDL
     SDL_Init(SDL_INIT_VIDEO);
 
 	// The window we'll be rendering to
-    std::string windowName = "c8cpp - " + chip8.gameName;
+    std::string windowName = "c8cpp - " + std::string(ROM_PATH);
 	SDL_Window* window = SDL_CreateWindow(windowName.c_str(), SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-		SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+		SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
 	if (window == NULL) {
 		printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
 	}
@@ -59,35 +61,116 @@ int _tmain(int argc, _TCHAR* argv[]) {
 	bool quit = false;
 
 	// Setup renderer
-	SDL_Renderer* renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-
-	// Event handler
-	SDL_Event e;
-
-	// main emulation loop
-	while (!quit) {
-		// Handle events on queue
-		while (SDL_PollEvent(&e) != 0) {
-			// User requests quit
-			if (e.type == SDL_QUIT) {
-				quit = true;
+	// No vsync, the frame pacer is the only clock
+	SDL_Renderer* renderer = SDL_CreateRenderer(window, 0, SDL_RENDERER_ACCELERATED);
+
+	// The screen is a 64x32 texture scaled up with nearest neighbour filtering,
+	// the logical size keeps its aspect ratio whatever the window size
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+	SDL_RenderSetLogicalSize(renderer, chip8.SCREEN_WIDTH, chip8.SCREEN_HEIGHT);
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+	// The screen's texture has to go before the renderer, so the loop gets a scope
+	{
+		Screen screen(renderer);
+		if (screen.texture == NULL) {
+			printf("Texture could not be created! SDL_Error: %s\n", SDL_GetError());
+		}
+
+		// Event handler
+		SDL_Event e;
+
+		// Set when the window needs repainting even though the screen didn't change
+		bool redraw = true;
+
+		// Frames to rewind to, and whether the rewind key is held. The history
+		// replays frames from their instruction counts and keys, so between
+		// frames the loop only sets keys and clears the beep and dirty rows, which
+		// no instruction reads. Anything else that changes the machine has to
+		// clear it, and a machine that isn't where the last frame left it does
+		Rewind history;
+		bool rewinding = false;
+		uint64_t recordedCycles = chip8.cycles;
+
+		// main emulation loop, one iteration per 60 Hz frame
+		FramePacer pacer(SCREEN_FPS);
+		while (!quit) {
+			// Handle events on queue
+			while (SDL_PollEvent(&e) != 0) {
+				// User requests quit
+				if (e.type == SDL_QUIT) {
+					quit = true;
+				}
+				// Rewind key held or let go
+				else if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && e.key.keysym.scancode == REWIND_KEY) {
+					rewinding = e.type == SDL_KEYDOWN;
+				}
+				// User presses a key
+				else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+					handleKey(chip8, e);
+				}
+				// Window resized or uncovered
+				else if (e.type == SDL_WINDOWEVENT) {
+					redraw = true;
+				}
 			}
-			// User presses a key
-			else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
-				chip8.handleKey(e);
+
+			// Emulate the frame's instructions, however many sprites they draw,
+			// or go back a frame while the rewind key is held
+			bool drew = false;
+			if (rewinding) {
+				if (history.rewind(chip8, 1)) {
+#if C8_JIT
+					// Compiled blocks may no longer match the restored memory
+					jit.reset();
+#endif
+					movie.truncate(chip8);
+					drew = true;
+				}
+			}
+			else {
+				if (chip8.cycles != recordedCycles) {
+					history.clear();
+				}
+				movie.record(chip8);
+#if C8_JIT
+				Chip8::RunResult result = jit.runFrame(chip8);
+#else
+				Chip8::RunResult result = chip8.runFrame();
+#endif
+				if (result == Chip8::RUN_ERROR) {
+					printf("Emulation stopped: %s\n", chip8.error.c_str());
+					quit = true;
+				}
+				drew = chip8.drawFlag;
+				history.record(chip8);
+			}
+			recordedCycles = chip8.cycles;
+			if (chip8.beep) {
+				printf("BEEP!\n");
+				chip8.beep = false;
 			}
-		}
 
-		// Emulate one cycle
-		chip8.emulateCycle();
+			// Present at most once per frame, and only if some row actually changed
+			if ((drew && chip8.dirtyRows() != 0) || redraw) {
+				drawGraphics(chip8, screen);
+				chip8.clearDirtyRows();
+				redraw = false;
+			}
+
+			// Sleep until the next frame is due
+			pacer.wait();
+		}
+		printf("%d frames, %.0f us mean and %.0f us worst lateness, busy %.1f%% of the time\n",
+			pacer.frames(), pacer.meanJitter(), pacer.maxJitter(), 100 * pacer.busy());
 
-		// If the draw flag is set, update the screen
-		if (chip8.drawFlag) {
-			drawGraphics(chip8, window, renderer);
+		movie.finish(chip8);
+		if (!movie.save(MOVIE_PATH)) {
+			printf("%s: %s\n", MOVIE_PATH, movie.error.c_str());
 		}
 	}
 
-	//Destroy window
+	//Destroy renderer and window
+	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 
 	//Quit SDL subsystems
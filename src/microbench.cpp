@@ -0,0 +1,312 @@
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "chip8.h"
+#include "rewind.h"
+#include "frontend.h"
+
+// Microbenchmarks for the kernels we tune, each timed in isolation so a
+// regression in one of them doesn't disappear inside whole-ROM numbers.
+// Every kernel is calibrated to run long enough for the clock, warmed up,
+// then sampled repeatedly and reported as percentiles of ns per operation.
+
+typedef std::chrono::steady_clock Clock;
+
+// A kernel runs its operation `iterations` times per call
+struct Kernel {
+	const char* name;
+	void (*run)(void* context, int iterations);
+	void* context;
+};
+
+// Shortest sample we trust the clock with
+static const double MIN_SAMPLE_SECONDS = 200e-6;
+
+static double timeKernel(const Kernel& kernel, int iterations) {
+	Clock::time_point start = Clock::now();
+	kernel.run(kernel.context, iterations);
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void measure(const Kernel& kernel, int warmup, int reps) {
+	// Grow the batch until one sample is long enough to time
+	int iterations = 1;
+	while (timeKernel(kernel, iterations) < MIN_SAMPLE_SECONDS && iterations < (1 << 24)) {
+		iterations *= 2;
+	}
+
+	for (int i = 0; i < warmup; i++) {
+		timeKernel(kernel, iterations);
+	}
+
+	std::vector<double> ns;
+	for (int i = 0; i < reps; i++) {
+		ns.push_back(timeKernel(kernel, iterations) * 1e9 / iterations);
+	}
+	std::sort(ns.begin(), ns.end());
+
+	printf("%-32s %9d %9.2f %9.2f %9.2f %9.2f %9.2f\n", kernel.name, iterations,
+		ns.front(), percentile(ns, 0.5), percentile(ns, 0.9), percentile(ns, 0.99), ns.back());
+}
+
+// Opcodes are written big endian into a ROM image
+static void putOpcode(std::vector<byte>& rom, u_short opcode) {
+	rom.push_back((byte)(opcode >> 8));
+	rom.push_back((byte)(opcode & 0xFF));
+}
+
+// A straight run of one opcode that jumps back to the start, so the
+// jump costs 1/count of the time
+static std::vector<byte> repeatOpcode(u_short opcode, int count) {
+	std::vector<byte> rom;
+	for (int i = 0; i < count; i++) {
+		putOpcode(rom, opcode);
+	}
+	putOpcode(rom, 0x1000 | Chip8::PROGRAM_START_LOC);
+	return rom;
+}
+
+// Sprite draws: a run of DXYN with VX, VY and the sprite at I set up beforehand
+struct SpriteBench {
+	Chip8 chip8;
+	SpriteBench(byte x, byte y, byte height) {
+		std::vector<byte> rom = repeatOpcode(0xD010 | height, 255);
+		chip8.initialize();
+		chip8.loadRom(rom.data(), rom.size());
+		// Lit sprite rows, so every draw sets pixels and collides every other time
+		u_short sprite = (u_short)(Chip8::PROGRAM_START_LOC + rom.size());
+		memset(chip8.memory + sprite, 0xFF, 16);
+		chip8.I = sprite;
+		chip8.V[0] = x;
+		chip8.V[1] = y;
+	}
+	static void run(void* context, int iterations) {
+		static_cast<SpriteBench*>(context)->chip8.emulateCycles(iterations);
+	}
+};
+
+// Fetch, decode and dispatch: a run of 7X01, the cheapest opcode there is
+struct DispatchBench {
+	Chip8 chip8;
+	DispatchBench() {
+		int count = (Chip8::MEMORY_SIZE - Chip8::PROGRAM_START_LOC) / 2 - 1;
+		std::vector<byte> rom = repeatOpcode(0x7001, count);
+		chip8.initialize();
+		chip8.loadRom(rom.data(), rom.size());
+	}
+	static void run(void* context, int iterations) {
+		static_cast<DispatchBench*>(context)->chip8.emulateCycles(iterations);
+	}
+};
+
+// Clearing a fully lit screen, refilling it is part of the measurement
+struct ClearBench {
+	Chip8 chip8;
+	ClearBench() {
+		chip8.initialize();
+	}
+	static void run(void* context, int iterations) {
+		Chip8& chip8 = static_cast<ClearBench*>(context)->chip8;
+		for (int i = 0; i < iterations; i++) {
+			memset(chip8.gfx, 0xFF, sizeof(chip8.gfx));
+			chip8.clearScreen();
+		}
+	}
+};
+
+// Save states: capturing the machine, and restoring one that differs from
+// the running machine in a few bytes of memory, as stepping back a frame does
+struct StateBench {
+	Chip8 chip8;
+	Chip8::State state;
+	StateBench() {
+		std::vector<byte> rom = repeatOpcode(0x7001, 64);
+		chip8.initialize();
+		chip8.loadRom(rom.data(), rom.size());
+		chip8.emulateCycles(1000);
+		chip8.saveState(state);
+	}
+	static void save(void* context, int iterations) {
+		StateBench& bench = *static_cast<StateBench*>(context);
+		for (int i = 0; i < iterations; i++) {
+			bench.chip8.saveState(bench.state);
+		}
+	}
+	static void load(void* context, int iterations) {
+		StateBench& bench = *static_cast<StateBench*>(context);
+		for (int i = 0; i < iterations; i++) {
+			bench.chip8.memory[0xF00] ^= 1;
+			bench.chip8.loadState(bench.state);
+		}
+	}
+};
+
+// Rewind history: recording one instruction frames of a machine that changes
+// a register every frame, keyframes and buffer wrap included
+struct RewindBench {
+	Chip8 chip8;
+	Rewind history;
+	RewindBench() : history(64 << 10) {
+		std::vector<byte> rom = repeatOpcode(0x7001, 64);
+		chip8.initialize();
+		chip8.loadRom(rom.data(), rom.size());
+	}
+	static void record(void* context, int iterations) {
+		RewindBench& bench = *static_cast<RewindBench*>(context);
+		for (int i = 0; i < iterations; i++) {
+			bench.chip8.emulateCycles(1);
+			bench.history.record(bench.chip8);
+		}
+	}
+};
+
+// Key events: presses and releases of every mapped key plus a few unmapped ones
+struct KeyBench {
+	Chip8 chip8;
+	std::vector<SDL_Event> events;
+	KeyBench() {
+		static const SDL_Scancode keys[] = {
+			SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
+			SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_R,
+			SDL_SCANCODE_A, SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_F,
+			SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C, SDL_SCANCODE_V,
+			SDL_SCANCODE_SPACE, SDL_SCANCODE_RETURN, SDL_SCANCODE_P, SDL_SCANCODE_LEFT
+		};
+		chip8.initialize();
+		for (SDL_Scancode key : keys) {
+			SDL_Event e;
+			memset(&e, 0, sizeof(e));
+			e.key.keysym.scancode = key;
+			e.type = SDL_KEYDOWN;
+			events.push_back(e);
+			e.type = SDL_KEYUP;
+			events.push_back(e);
+		}
+	}
+	static void run(void* context, int iterations) {
+		KeyBench& bench = *static_cast<KeyBench*>(context);
+		size_t next = 0;
+		for (int i = 0; i < iterations; i++) {
+			handleKey(bench.chip8, bench.events[next]);
+			if (++next == bench.events.size()) {
+				next = 0;
+			}
+		}
+	}
+};
+
+// Presenting a screen with every row dirty through a software renderer,
+// which needs no window or video driver
+struct RenderBench {
+	Chip8 chip8;
+	SDL_Surface* surface;
+	SDL_Renderer* renderer;
+	std::unique_ptr<Screen> screen;
+	RenderBench() : surface(NULL), renderer(NULL) {
+		chip8.initialize();
+		// A checkerboard, so neither pixel colour dominates
+		for (int i = 0; i < Chip8::SCREEN_HEIGHT; i++) {
+			chip8.gfx[i] = (i & 1) ? 0xAAAAAAAAAAAAAAAAull : 0x5555555555555555ull;
+		}
+		surface = SDL_CreateRGBSurface(0, 640, 320, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+		if (surface != NULL) {
+			renderer = SDL_CreateSoftwareRenderer(surface);
+		}
+		if (renderer != NULL) {
+			SDL_RenderSetLogicalSize(renderer, Chip8::SCREEN_WIDTH, Chip8::SCREEN_HEIGHT);
+			screen.reset(new Screen(renderer));
+		}
+	}
+	~RenderBench() {
+		// The texture goes before its renderer
+		screen.reset();
+		if (renderer != NULL) SDL_DestroyRenderer(renderer);
+		if (surface != NULL) SDL_FreeSurface(surface);
+	}
+	static void run(void* context, int iterations) {
+		RenderBench& bench = *static_cast<RenderBench*>(context);
+		for (int i = 0; i < iterations; i++) {
+			drawGraphics(bench.chip8, *bench.screen);
+		}
+	}
+};
+
+static void printUsage(const char* name) {
+	printf("Usage: %s [options] [kernel...]\n", name);
+	printf("  --reps N    samples per kernel (default 101)\n");
+	printf("  --warmup N  untimed samples first (default 10)\n");
+	printf("Kernels run when their name contains one of the given words, all of them by default.\n");
+}
+
+int main(int argc, char* argv[]) {
+	int reps = 101;
+	int warmup = 10;
+	std::vector<std::string> filters;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--reps" && i + 1 < argc) {
+			reps = atoi(argv[++i]);
+		}
+		else if (arg == "--warmup" && i + 1 < argc) {
+			warmup = atoi(argv[++i]);
+		}
+		else if (arg.compare(0, 2, "--") == 0) {
+			printUsage(argv[0]);
+			return 2;
+		}
+		else {
+			filters.push_back(arg);
+		}
+	}
+	if (reps <= 0 || warmup < 0) {
+		printUsage(argv[0]);
+		return 2;
+	}
+
+	SpriteBench spriteAligned(8, 0, 8);
+	SpriteBench spriteWrapping(60, 28, 15);
+	DispatchBench dispatch;
+	ClearBench clear;
+	StateBench state;
+	RewindBench rewind;
+	KeyBench keys;
+	RenderBench render;
+	if (!render.screen || render.screen->texture == NULL) {
+		printf("Software renderer unavailable: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	const Kernel kernels[] = {
+		{ "dxyn aligned 8 rows", SpriteBench::run, &spriteAligned },
+		{ "dxyn wrapping 15 rows", SpriteBench::run, &spriteWrapping },
+		{ "dispatch 7xnn", DispatchBench::run, &dispatch },
+		{ "clearScreen lit", ClearBench::run, &clear },
+		{ "saveState", StateBench::save, &state },
+		{ "loadState one block changed", StateBench::load, &state },
+		{ "rewind record", RewindBench::record, &rewind },
+		{ "handleKey", KeyBench::run, &keys },
+		{ "drawGraphics all dirty", RenderBench::run, &render },
+	};
+
+	printf("%-32s %9s %9s %9s %9s %9s %9s\n", "ns/op", "batch", "min", "p50", "p90", "p99", "max");
+	for (const Kernel& kernel : kernels) {
+		bool selected = filters.empty();
+		for (const std::string& filter : filters) {
+			selected |= strstr(kernel.name, filter.c_str()) != NULL;
+		}
+		if (selected) {
+			measure(kernel, warmup, reps);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include "movie.h"
+
+// Identifies a movie file, followed by the version and the session's settings
+static const char MOVIE_MAGIC[4] = { 'C', '8', 'M', 'V' };
+
+struct MovieFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t programHash;
+	uint64_t seed;
+	int32_t cyclesPerSecond;
+	uint32_t reserved;
+};
+
+// Bits below the distance in an encoded change: the pressed bit and the key
+static const int EVENT_SHIFT = 5;
+
+static void putVarint(std::vector<byte>& out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back((byte)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((byte)value);
+}
+
+// Reads a varint from [p, end), false if it runs past the end or overflows
+static bool getVarint(const byte*& p, const byte* end, uint64_t& value) {
+	value = 0;
+	for (int shift = 0; shift < 64 && p < end; shift += 7) {
+		byte b = *p++;
+		value |= (uint64_t)(b & 0x7F) << shift;
+		if (b < 0x80) {
+			return true;
+		}
+	}
+	return false;
+}
+
+Movie::Movie() {
+	programHash = 0;
+	seed = 0;
+	cyclesPerSecond = Chip8::DEFAULT_CYCLES_PER_SECOND;
+	length = 0;
+	memset(held, 0, sizeof(held));
+}
+
+void Movie::start(const Chip8& chip8, uint64_t seed) {
+	programHash = hashProgram(chip8);
+	this->seed = seed;
+	cyclesPerSecond = chip8.cyclesPerSecond;
+	length = chip8.cycles;
+	events.clear();
+	memcpy(held, chip8.keys, sizeof(held));
+}
+
+void Movie::record(const Chip8& chip8) {
+	for (int i = 0; i < 16; i++) {
+		if (chip8.keys[i] != held[i]) {
+			Event e = { chip8.cycles, (byte)i, chip8.keys[i] != 0 };
+			events.push_back(e);
+			held[i] = chip8.keys[i];
+		}
+	}
+	length = chip8.cycles;
+}
+
+void Movie::truncate(const Chip8& chip8) {
+	while (!events.empty() && events.back().at >= chip8.cycles) {
+		events.pop_back();
+	}
+	memcpy(held, chip8.keys, sizeof(held));
+	length = chip8.cycles;
+}
+
+bool Movie::save(const std::string& fileName) {
+	MovieFileHeader header;
+	memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+	header.version = MOVIE_VERSION;
+	header.programHash = programHash;
+	header.seed = seed;
+	header.cyclesPerSecond = cyclesPerSecond;
+	header.reserved = 0;
+
+	std::vector<byte> body;
+	putVarint(body, events.size());
+	uint64_t last = 0;
+	for (const Event& e : events) {
+		putVarint(body, (e.at - last) << EVENT_SHIFT | (e.pressed ? 0x10 : 0) | e.key);
+		last = e.at;
+	}
+	putVarint(body, length - last);
+
+	FILE* file = fopen(fileName.c_str(), "wb");
+	if (file == NULL) {
+		error = "Unable to create file.";
+		return false;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(body.data(), 1, body.size(), file) == body.size();
+	if (fclose(file) != 0 || !written) {
+		error = "Unable to write movie.";
+		return false;
+	}
+	return true;
+}
+
+bool Movie::load(const std::string& fileName) {
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (file == NULL) {
+		error = "Unable to open file.";
+		return false;
+	}
+	MovieFileHeader header;
+	bool read = fread(&header, sizeof(header), 1, file) == 1;
+	if (read && memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0) {
+		fclose(file);
+		error = "Not a movie.";
+		return false;
+	}
+	if (read && header.version != MOVIE_VERSION) {
+		fclose(file);
+		error = "Movie from another version.";
+		return false;
+	}
+	std::vector<byte> body;
+	byte chunk[4096];
+	for (size_t n; read && (n = fread(chunk, 1, sizeof(chunk), file)) > 0; ) {
+		body.insert(body.end(), chunk, chunk + n);
+	}
+	fclose(file);
+	if (!read) {
+		error = "Movie is truncated.";
+		return false;
+	}
+
+	// Every change takes a byte at least, which bounds a sane count
+	const byte* p = body.data();
+	const byte* end = p + body.size();
+	uint64_t count;
+	std::vector<Event> decoded;
+	bool valid = getVarint(p, end, count) && count <= body.size();
+	uint64_t at = 0;
+	for (uint64_t i = 0; valid && i < count; i++) {
+		uint64_t value;
+		valid = getVarint(p, end, value);
+		at += value >> EVENT_SHIFT;
+		Event e = { at, (byte)(value & 0xF), (value & 0x10) != 0 };
+		decoded.push_back(e);
+	}
+	uint64_t tail;
+	if (!valid || !getVarint(p, end, tail)) {
+		error = "Movie is truncated.";
+		return false;
+	}
+
+	programHash = header.programHash;
+	seed = header.seed;
+	cyclesPerSecond = header.cyclesPerSecond;
+	length = at + tail;
+	events.swap(decoded);
+	memset(held, 0, sizeof(held));
+	return true;
+}
+
+uint64_t Movie::hashProgram(const Chip8& chip8) {
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = Chip8::PROGRAM_START_LOC; i < Chip8::MEMORY_SIZE; i++) {
+		hash = (hash ^ chip8.memory[i]) * 1099511628211ull;
+	}
+	return hash;
+}
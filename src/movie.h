@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+/*
+ * Input movie: every change of the keypad during a session, tagged with the
+ * instruction it came before, plus what else decides how the session plays
+ * out (a hash of the program, the CXNN seed and the clock rate). Replaying
+ * the changes at the same instructions runs exactly the same instructions
+ * again, as fast as the host allows, which turns a played session into a
+ * repeatable workload.
+ *
+ * The file is a small header (magic, MOVIE_VERSION, program hash, seed, rate)
+ * followed by varints: the number of changes, each change as its distance in
+ * instructions from the one before shifted left by 5 with the pressed bit and
+ * the key below, and finally the instructions run after the last change.
+ */
+class Movie {
+public:
+	/* Bumped whenever the file layout changes, files of another version are refused */
+	static const uint32_t MOVIE_VERSION = 1;
+
+	/* A key pressed or released before the instruction numbered at */
+	struct Event {
+		uint64_t at;
+		byte key;
+		bool pressed;
+	};
+
+	Movie();
+
+	/* Identifies the program, see hashProgram */
+	uint64_t programHash;
+
+	/* What the machine's generator was seeded with */
+	uint64_t seed;
+
+	/* Instructions per emulated second */
+	int cyclesPerSecond;
+
+	/* Instructions the session ran */
+	uint64_t length;
+
+	/* The key changes in order */
+	std::vector<Event> events;
+
+	/* What made the last save or load fail */
+	std::string error;
+
+	/* Start a movie of a machine that has just loaded its program and been
+	   seeded with seed, before it runs anything */
+	void start(const Chip8& chip8, uint64_t seed);
+
+	/* Log the keys that changed since the last call, at the machine's current
+	   instruction. Call whenever input may have changed, once per frame will do */
+	void record(const Chip8& chip8);
+
+	/* Drop the changes from the machine's current instruction on, after it
+	   was rewound or restored to an earlier point of the session */
+	void truncate(const Chip8& chip8);
+
+	/* Mark the end of the session at the machine's current instruction */
+	void finish(const Chip8& chip8) { length = chip8.cycles; }
+
+	/* Write or read a movie file, return false with error set on failure */
+	bool save(const std::string& fileName);
+	bool load(const std::string& fileName);
+
+	/* FNV-1a over the program area, the same for every load of one ROM */
+	static uint64_t hashProgram(const Chip8& chip8);
+private:
+	/* The keys as of the last record */
+	byte held[16];
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Small, fast random number generator for CXNN: PCG32 (XSH RR output on a
+ * 64 bit LCG, O'Neill 2014). Each emulator owns one, so instances running in
+ * parallel share no state, and the same seed always gives the same numbers.
+ * The whole generator is the state word, which is what a snapshot keeps.
+ */
+class Random {
+public:
+	/* Seed used by Chip8::initialize, pick another with seed() */
+	static const uint64_t DEFAULT_SEED = 0xC8C8C8C8ull;
+
+	explicit Random(uint64_t value = DEFAULT_SEED) { seed(value); }
+
+	/* Restart the sequence, equal seeds give equal sequences */
+	void seed(uint64_t value) {
+		state = 0;
+		next();
+		state += value;
+		next();
+	}
+
+	/* The next 32 random bits */
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * MULTIPLIER + INCREMENT;
+		uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rot = (uint32_t)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	uint64_t state;
+private:
+	static const uint64_t MULTIPLIER = 6364136223846793005ull;
+	static const uint64_t INCREMENT = 1442695040888963407ull;
+};
@@ -0,0 +1,304 @@
+#include <string.h>
+#include "rewind.h"
+
+static const int STATE_SIZE = sizeof(Chip8::State);
+static_assert(sizeof(Chip8::State) % 8 == 0, "states are encoded a word at a time");
+
+static const int STATE_WORDS = STATE_SIZE / 8;
+
+// Largest encoding of a keyframe: a run at most every third word, each with
+// two varints of two bytes in front
+static const size_t MAX_ENCODED_SIZE = STATE_SIZE + (STATE_WORDS / 3 + 1) * 4;
+
+// Words checked at once while looking for what isn't 0
+static const int BLOCK_WORDS = 8;
+
+// nextCycles while no run is open, no machine runs this many instructions
+static const uint64_t NO_RUN = UINT64_MAX;
+
+static inline uint64_t word(const byte* p, int offset) {
+	uint64_t w;
+	memcpy(&w, p + offset, sizeof(w));
+	return w;
+}
+
+static inline byte* putVarint(byte* out, uint32_t value) {
+	while (value >= 0x80) {
+		*out++ = (byte)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (byte)value;
+	return out;
+}
+
+static inline uint32_t getVarint(const byte*& p) {
+	uint32_t value = 0;
+	for (int shift = 0; ; shift += 7) {
+		byte b = *p++;
+		value |= (uint32_t)(b & 0x7F) << shift;
+		if (b < 0x80) {
+			return value;
+		}
+	}
+}
+
+Rewind::Rewind(size_t capacity, int keyframeInterval) {
+	// Room for a few keyframes at least, whatever was asked for
+	this->capacity = capacity > 4 * MAX_ENCODED_SIZE ? capacity : 4 * MAX_ENCODED_SIZE;
+	interval = keyframeInterval < 1 ? 1 : keyframeInterval;
+	scratch.resize(MAX_ENCODED_SIZE);
+	clear();
+}
+
+size_t Rewind::encode(const Chip8::State& state, byte* out) {
+	const byte* s = reinterpret_cast<const byte*>(&state);
+	byte* p = out;
+
+	// Runs of words that aren't 0, a single zero word inside a run costs less
+	// than the varints of a new one
+	int last = 0;
+	for (int i = 0; i < STATE_WORDS; ) {
+		// Most of memory is empty, pass over it a block at a time
+		if (i % BLOCK_WORDS == 0 && i + BLOCK_WORDS <= STATE_WORDS) {
+			uint64_t any = 0;
+			for (int k = 0; k < BLOCK_WORDS; k++) {
+				any |= word(s, (i + k) * 8);
+			}
+			if (any == 0) {
+				i += BLOCK_WORDS;
+				continue;
+			}
+		}
+		if (word(s, i * 8) == 0) {
+			i++;
+			continue;
+		}
+		int end = i + 1;
+		while (end < STATE_WORDS) {
+			if (word(s, end * 8) != 0) {
+				end++;
+			} else if (end + 1 < STATE_WORDS && word(s, end * 8 + 8) != 0) {
+				end += 2;
+			} else {
+				break;
+			}
+		}
+		p = putVarint(p, i * 8 - last);
+		p = putVarint(p, (end - i) * 8);
+		memcpy(p, s + i * 8, (end - i) * 8);
+		p += (end - i) * 8;
+		last = end * 8;
+		i = end;
+	}
+	return p - out;
+}
+
+void Rewind::decode(const byte* encoded, size_t size, Chip8::State& state) {
+	byte* s = reinterpret_cast<byte*>(&state);
+	memset(s, 0, STATE_SIZE);
+	const byte* p = encoded;
+	const byte* end = encoded + size;
+	int offset = 0;
+	while (p < end) {
+		offset += getVarint(p);
+		int length = getVarint(p);
+		memcpy(s + offset, p, length);
+		p += length;
+		offset += length;
+	}
+}
+
+void Rewind::recordFrame(const Chip8& chip8) {
+	// The frame's entry goes after the repeat count of the run it ends
+	byte entry[16];
+	byte* p = runOpen ? endRun(entry) : entry;
+
+	// A machine that went back or ran far needs a keyframe, and so do long
+	// runs of frames
+	if (segments.empty() || chip8.cycles < lastCycles ||
+			chip8.cycles - keyframeCycles >= (uint64_t)interval ||
+			frameCount - keyframeFrame >= MAX_FRAMES_PER_KEYFRAME) {
+		if (p != entry) {
+			append(entry, p);
+		}
+		addKeyframe(chip8);
+		return;
+	}
+
+	// Start a run with this frame
+	uint64_t keys[2];
+	memcpy(keys, chip8.keys, sizeof(keys));
+	bool keysChanged = keys[0] != lastKeys[0] || keys[1] != lastKeys[1];
+	uint64_t delta = chip8.cycles - lastCycles;
+	p = putVarint(p, (uint32_t)delta << 1 | (keysChanged ? 1 : 0));
+	if (keysChanged) {
+		int mask = 0;
+		for (int k = 0; k < 16; k++) {
+			mask |= (chip8.keys[k] != 0) << k;
+		}
+		*p++ = (byte)mask;
+		*p++ = (byte)(mask >> 8);
+		lastKeys[0] = keys[0];
+		lastKeys[1] = keys[1];
+	}
+	append(entry, p);
+	openRun(frameCount, chip8.cycles, delta);
+	if (used > capacity) {
+		dropOldest();
+	}
+}
+
+void Rewind::append(const byte* begin, const byte* end) {
+	std::vector<byte>& frames = segments.back().frames;
+	frames.insert(frames.end(), begin, end);
+	used += end - begin;
+}
+
+void Rewind::openRun(int first, uint64_t cycles, uint64_t delta) {
+	runFirst = first;
+	runCycles = cycles;
+	lastDelta = delta;
+	nextCycles = cycles + delta;
+	runOpen = true;
+
+	// Work out the instruction count the run makes way for a keyframe at now,
+	// so joining it stays a couple of compares
+	stopCycles = keyframeCycles + interval;
+	uint64_t frameCap = cycles + (uint64_t)(keyframeFrame + MAX_FRAMES_PER_KEYFRAME - first) * delta;
+	if (frameCap < stopCycles) {
+		stopCycles = frameCap;
+	}
+}
+
+void Rewind::closeRun() {
+	if (runOpen) {
+		byte entry[8];
+		append(entry, endRun(entry));
+	}
+}
+
+byte* Rewind::endRun(byte* out) {
+	int count = runFrames();
+	frameCount = runFirst + count;
+	lastCycles = nextCycles - lastDelta;
+	nextCycles = NO_RUN;
+	runOpen = false;
+	return putVarint(out, count - 1);
+}
+
+void Rewind::addKeyframe(const Chip8& chip8) {
+	closeRun();
+	chip8.saveState(current);
+	size_t size = encode(current, scratch.data());
+
+	if (!segments.empty()) {
+		segments.back().count = frameCount - keyframeFrame;
+	}
+	segments.push_back(Segment());
+	Segment& segment = segments.back();
+	segment.keyframe.assign(scratch.data(), scratch.data() + size);
+	segment.cycles = chip8.cycles;
+	segment.count = 1;
+	keyframeFrame = frameCount;
+	keyframeCycles = chip8.cycles;
+	frameCount++;
+	used += size;
+	lastCycles = chip8.cycles;
+	memcpy(lastKeys, chip8.keys, sizeof(lastKeys));
+
+	// The newest keyframe stays, whatever the capacity
+	while (used > capacity && segments.size() > 1) {
+		dropOldest();
+	}
+}
+
+void Rewind::dropOldest() {
+	// Frames need the keyframe before them, so a keyframe goes with its frames
+	if (segments.size() == 1) {
+		return;
+	}
+	const Segment& oldest = segments.front();
+	used -= oldest.keyframe.size() + oldest.frames.size();
+	frameCount -= oldest.count;
+	keyframeFrame -= oldest.count;
+	runFirst -= oldest.count;
+	segments.pop_front();
+}
+
+bool Rewind::rewind(Chip8& chip8, int count) {
+	if (count < 0 || count >= frames()) {
+		return false;
+	}
+	closeRun();
+	int target = frameCount - 1 - count;
+	while (keyframeFrame > target) {
+		const Segment& newest = segments.back();
+		used -= newest.keyframe.size() + newest.frames.size();
+		frameCount = keyframeFrame;
+		segments.pop_back();
+		keyframeFrame = frameCount - segments.back().count;
+		keyframeCycles = segments.back().cycles;
+	}
+
+	// Decode the keyframe and run the frames after it again, as they ran the
+	// first time: the keys set first, and a key wait lets the rest of a frame pass
+	Segment& segment = segments.back();
+	decode(segment.keyframe.data(), segment.keyframe.size(), current);
+	chip8.loadState(current);
+	const byte* p = segment.frames.data();
+	uint32_t frames = 0;
+	for (int frame = keyframeFrame + 1; frame <= target; frame += frames) {
+		uint32_t head = getVarint(p);
+		if (head & 1) {
+			int mask = p[0] | p[1] << 8;
+			p += 2;
+			for (int k = 0; k < 16; k++) {
+				chip8.setKey(k, ((mask >> k) & 1) != 0);
+			}
+		}
+		const byte* headEnd = p;
+		frames = getVarint(p) + 1;
+		if (frame + (int)frames - 1 > target) {
+			// The run goes past the restored frame
+			frames = target - frame + 1;
+		}
+		uint64_t delta = head >> 1;
+		uint64_t first = chip8.cycles + delta;
+		for (uint32_t i = 0; i < frames; i++) {
+			uint64_t end = chip8.cycles + delta;
+			if (chip8.runCycles((int)delta) == Chip8::RUN_KEY_WAIT) {
+				chip8.cycles = end;
+			}
+		}
+		if (frame + (int)frames > target) {
+			// Recording carries on inside the run of the restored frame
+			p = headEnd;
+			openRun(frame, first, delta);
+			nextCycles = chip8.cycles + delta;
+		}
+	}
+
+	size_t keep = p - segment.frames.data();
+	used -= segment.frames.size() - keep;
+	segment.frames.resize(keep);
+	frameCount = target + 1;
+	lastCycles = chip8.cycles;
+	memcpy(lastKeys, chip8.keys, sizeof(lastKeys));
+	return true;
+}
+
+void Rewind::clear() {
+	segments.clear();
+	used = 0;
+	frameCount = 0;
+	keyframeFrame = 0;
+	keyframeCycles = 0;
+	lastCycles = 0;
+	lastKeys[0] = lastKeys[1] = 0;
+	runFirst = 0;
+	runCycles = 0;
+	lastDelta = 0;
+	nextCycles = NO_RUN;
+	stopCycles = 0;
+	runOpen = false;
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include "chip8.h"
+
+/*
+ * Rewind history: every frame of the machine in a bounded buffer, to step
+ * back in time while debugging. Every keyframe interval of instructions the
+ * whole state is stored as a keyframe, and each frame after it as the
+ * instructions it ran and, when they changed, the keys. The machine is
+ * deterministic, so restoring a frame decodes its keyframe and runs the
+ * frames up to it again, at most one keyframe interval of instructions.
+ * Recording a frame that ran like the one before only compares its
+ * instruction count and keys, other frames append a few bytes.
+ *
+ * Keyframes are encoded as runs of (zero bytes to skip, length, bytes) with
+ * varint counts, a word at a time, which leaves out the empty parts of
+ * memory. The keys are taken to change between frames, before the frame
+ * runs, as the front end polls its input. Anything else that changes the
+ * machine from outside, like loadState, needs a clear, or restores go wrong
+ * from then on: the SDL front end clears the history whenever the machine
+ * isn't where its last frame left it.
+ */
+class Rewind {
+public:
+	/* Bytes of history kept by default, days of the bundled games */
+	static const size_t DEFAULT_CAPACITY = 4 << 20;
+
+	/* Instructions from one keyframe to the next by default. A restore runs at
+	   most this many again, well under a millisecond, and the keyframes, about
+	   a microsecond each, come thousands of frames apart at 600 Hz */
+	static const int DEFAULT_KEYFRAME_INTERVAL = 30000;
+
+	explicit Rewind(size_t capacity = DEFAULT_CAPACITY, int keyframeInterval = DEFAULT_KEYFRAME_INTERVAL);
+
+	/* Record the machine as the newest frame, call once per frame. Once the
+	   buffer is full the oldest frames make room, a keyframe and its frames
+	   at a time. A frame that ran as many instructions as the one before with
+	   the same keys only counts itself */
+	void record(const Chip8& chip8) {
+		uint64_t keys[2];
+		memcpy(keys, chip8.keys, sizeof(keys));
+		if (chip8.cycles == nextCycles && chip8.cycles < stopCycles && ((keys[0] ^ lastKeys[0]) | (keys[1] ^ lastKeys[1])) == 0) {
+			nextCycles += lastDelta;
+			return;
+		}
+		recordFrame(chip8);
+	}
+
+	/* Restore the frame count frames before the newest one and drop the newer
+	   ones, so recording carries on from there. Returns false, leaving the
+	   machine alone, if fewer frames are held. A Jit has to be reset after */
+	bool rewind(Chip8& chip8, int count);
+
+	/* Frames held, the newest one included */
+	int frames() const { return runOpen ? runFirst + runFrames() : frameCount; }
+
+	/* Bytes the held frames take up, their index included */
+	size_t bytes() const { return used + segments.size() * sizeof(Segment); }
+
+	/* Drop every frame */
+	void clear();
+private:
+	/* Frames after a keyframe at most, a replay costs a run call per frame
+	   even when it runs no instructions */
+	static const int MAX_FRAMES_PER_KEYFRAME = 8192;
+
+	/* A keyframe and the frames recorded after it. The frames come in runs:
+	   varint(instructions << 1 | keys changed), the 16 key bits if changed,
+	   then varint(frames after the first that ran as many instructions with
+	   the same keys) */
+	struct Segment {
+		std::vector<byte> keyframe; // the encoded state
+		std::vector<byte> frames;
+		uint64_t cycles;            // the keyframe's instruction count
+		int count;                  // frames, the keyframe included, kept up to date once a newer segment starts
+	};
+
+	std::deque<Segment> segments;
+	size_t capacity;
+	size_t used; // encoded bytes of the held frames
+	int interval;
+	int frameCount; // only kept up to date while no run is open
+
+	/* The newest segment: where its keyframe is among the held frames, and its instruction count */
+	int keyframeFrame;
+	uint64_t keyframeCycles;
+
+	/* The newest frame's instruction count and keys. lastCycles is only kept
+	   up to date while no run is open */
+	uint64_t lastCycles;
+	uint64_t lastKeys[2];
+
+	/* The open run: where its first frame is and that frame's instruction
+	   count, the instructions each of its frames ran, the instruction count a
+	   frame needs to join it and the one a keyframe is due at. nextCycles is
+	   out of reach while no run is open */
+	int runFirst;
+	uint64_t runCycles;
+	uint64_t lastDelta;
+	uint64_t nextCycles;
+	uint64_t stopCycles;
+	bool runOpen;
+
+	/* Scratch space for keyframes */
+	Chip8::State current;
+	std::vector<byte> scratch;
+
+	/* Record a frame that starts a run or a keyframe */
+	void recordFrame(const Chip8& chip8);
+
+	/* Open a run at frame first, which ran delta instructions up to cycles */
+	void openRun(int first, uint64_t cycles, uint64_t delta);
+
+	/* Frames in the open run, a frame that ran no instructions has one to
+	   itself. A run spans less than two keyframe intervals */
+	int runFrames() const { return lastDelta ? (int)((uint32_t)(nextCycles - runCycles) / (uint32_t)lastDelta) : 1; }
+
+	/* Write the repeat count of the open run */
+	void closeRun();
+
+	/* Close the open run, putting its repeat count at out. Returns the end of it */
+	byte* endRun(byte* out);
+
+	/* Add encoded frames to the newest segment */
+	void append(const byte* begin, const byte* end);
+
+	/* Start a new segment with the machine as its keyframe */
+	void addKeyframe(const Chip8& chip8);
+
+	/* Drop the oldest keyframe and its frames */
+	void dropOldest();
+
+	/* Encode state into out, returns the encoded size */
+	static size_t encode(const Chip8::State& state, byte* out);
+
+	/* Decode an encoded keyframe into state */
+	static void decode(const byte* encoded, size_t size, Chip8::State& state);
+};
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <algorithm>
+#include "jit.h"
+#include "script.h"
+
+int parseKeyEvent(const char* text, KeyEvent& event) {
+	unsigned long long at;
+	unsigned key;
+	int state, length;
+	if (sscanf(text, " %llu:%x:%d%n", &at, &key, &state, &length) != 3) {
+		return 0;
+	}
+	event.at = at;
+	event.key = (int)(key & 0xF);
+	event.pressed = state != 0;
+	return length;
+}
+
+// Continue an FNV-1a hash over the low size bytes of value, lowest first
+static uint32_t hashValue(uint32_t hash, uint64_t value, int size) {
+	for (int b = 0; b < size; b++) {
+		hash = (hash ^ (byte)(value >> (8 * b))) * 16777619u;
+	}
+	return hash;
+}
+
+uint32_t hashScreen(const Chip8& chip8) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < Chip8::SCREEN_HEIGHT; i++) {
+		for (int b = 0; b < 8; b++) {
+			hash = (hash ^ (byte)(chip8.gfx[i] >> (56 - 8 * b))) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+uint32_t hashState(const Chip8& chip8) {
+	uint32_t hash = hashScreen(chip8);
+	for (int i = 0; i < Chip8::NUM_REGISTERS; i++) {
+		hash = hashValue(hash, chip8.V[i], 1);
+	}
+	hash = hashValue(hash, chip8.pc, 2);
+	hash = hashValue(hash, chip8.I, 2);
+	hash = hashValue(hash, chip8.sp, 2);
+	for (int i = 0; i < Chip8::NUM_LEVEL_STACK; i++) {
+		hash = hashValue(hash, chip8.stack[i], 2);
+	}
+	for (int i = 0; i < Chip8::MEMORY_SIZE; i++) {
+		hash = hashValue(hash, chip8.memory[i], 1);
+	}
+	hash = hashValue(hash, chip8.delayTimer(), 1);
+	hash = hashValue(hash, chip8.soundTimer(), 1);
+	hash = hashValue(hash, chip8.cycles, 8);
+	hash = hashValue(hash, chip8.rng.state, 8);
+	return hash;
+}
+
+void KeyScript::add(const KeyEvent& event) {
+	// Events mostly come in order, so this is usually the end
+	std::vector<KeyEvent>::iterator at = std::upper_bound(events.begin(), events.end(), event,
+		[](const KeyEvent& a, const KeyEvent& b) { return a.at < b.at; });
+	events.insert(at, event);
+}
+
+void KeyScript::apply(Chip8& chip8) {
+	while (next < events.size() && events[next].at <= chip8.cycles) {
+		chip8.setKey(events[next].key, events[next].pressed);
+		next++;
+	}
+}
+
+Chip8::RunResult KeyScript::run(Chip8& chip8, uint64_t end, Jit* jit) {
+	uint64_t target = next < events.size() && events[next].at < end ? events[next].at : end;
+	int count = (int)std::min<uint64_t>(target - chip8.cycles, 1 << 30);
+	Chip8::RunResult result = jit != NULL ? jit->runCycles(chip8, count) : chip8.runCycles(count);
+	if (result == Chip8::RUN_KEY_WAIT) {
+		// Nothing changes until the next key event, skip straight to it
+		skip(chip8, target);
+	}
+	return result;
+}
+
+void KeyScript::skip(Chip8& chip8, uint64_t to) {
+	if (to > chip8.cycles) {
+		waited += to - chip8.cycles;
+		chip8.cycles = to;
+	}
+}
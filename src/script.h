@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "chip8.h"
+
+class Jit;
+
+/* A scripted key change, applied before the instruction numbered at */
+struct KeyEvent {
+	uint64_t at;
+	int key;
+	bool pressed;
+};
+
+/* Parse an AT:KEY:STATE event (instruction, key 0-F, 1 to press or 0 to
+   release) at the start of text, after any blanks. Returns the characters
+   read, 0 if text doesn't start with an event */
+int parseKeyEvent(const char* text, KeyEvent& event);
+
+/* FNV-1a over the framebuffer rows */
+uint32_t hashScreen(const Chip8& chip8);
+
+/* The same continued over everything else a run leaves behind: V, pc, I,
+   sp, the stack, memory, the timers, the instruction count and the random
+   number generator. Equal hashes mean equal runs; keys and the draw and
+   beep flags are left out */
+uint32_t hashState(const Chip8& chip8);
+
+/*
+ * Plays scripted key changes into a machine as it runs, the way the command
+ * line tools drive their sessions. A machine waiting for a key runs nothing
+ * until the next change, so those cycles pass in one step and are counted
+ * in waited rather than run.
+ */
+class KeyScript {
+public:
+	KeyScript() : waited(0), next(0) {}
+
+	/* Cycles passed over waiting for a key */
+	uint64_t waited;
+
+	/* Add an event, kept in order of at and after the events added before it
+	   at the same instruction. Add them all before the first apply */
+	void add(const KeyEvent& event);
+
+	/* Whether some event hasn't been applied yet */
+	bool pending() const { return next < events.size(); }
+
+	/* Set the keys of the events due at the machine's current instruction */
+	void apply(Chip8& chip8);
+
+	/* Run up to the next event or end, whichever comes first, after apply. A
+	   key wait lets the cycles up to there pass without running anything.
+	   Given a Jit, the instructions run through it */
+	Chip8::RunResult run(Chip8& chip8, uint64_t end, Jit* jit = NULL);
+
+	/* Let the machine's cycles up to to pass without running anything */
+	void skip(Chip8& chip8, uint64_t to);
+private:
+	std::vector<KeyEvent> events;
+	size_t next;
+};
@@ -5,10 +5,13 @@
 
 #pragma once
 
-#include "targetver.h"
-
 #include <stdio.h>
+
+// Only the SDL front end needs the Windows scaffolding, the core builds anywhere
+#ifdef _WIN32
+#include "targetver.h"
 #include <tchar.h>
+#endif
 
 
 